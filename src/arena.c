@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "types.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_BLOCK 8192
+#define ARENA_MAX_BLOCK (1 << 20)
+
+#define ALIGN(size) (((size) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+#define BLOCK_HEADER ALIGN(sizeof(arena_block))
+
+static arena_block *arena_block_alloc(size_t size) {
+	arena_block *block;
+
+	block = malloc(BLOCK_HEADER + size);
+	if (block == NULL) return NULL;
+
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+arena_t *arena_alloc(void) {
+	arena_t *arena;
+
+	arena = malloc(sizeof(arena_t));
+	if (arena == NULL) return NULL;
+
+	arena->blocks = arena_block_alloc(ARENA_BLOCK);
+	if (arena->blocks == NULL) {
+		free(arena);
+		return NULL;
+	}
+
+	return arena;
+}
+
+void *arena_get(arena_t *arena, size_t size) {
+	arena_block *block = arena->blocks;
+	void *mem;
+
+	size = ALIGN(size);
+
+	if (size > block->size - block->used) {
+		size_t block_size = block->size < ARENA_MAX_BLOCK ? block->size * 2 : block->size;
+
+		if (block_size < size)
+			block_size = size;
+
+		block = arena_block_alloc(block_size);
+		if (block == NULL) return NULL;
+
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	mem = (char *)block + BLOCK_HEADER + block->used;
+	block->used += size;
+	return mem;
+}
+
+void arena_reset(arena_t *arena) {
+	arena_block *block = arena->blocks->next;
+
+	while (block != NULL) {
+		arena_block *next = block->next;
+
+		free(block);
+		block = next;
+	}
+
+	/* keep the most recent (largest) block */
+	arena->blocks->next = NULL;
+	arena->blocks->used = 0;
+}
+
+void arena_free(arena_t **arena) {
+	arena_block *block;
+
+	if (*arena == NULL) return;
+
+	block = (*arena)->blocks;
+	while (block != NULL) {
+		arena_block *next = block->next;
+
+		free(block);
+		block = next;
+	}
+
+	free(*arena);
+	*arena = NULL;
+}
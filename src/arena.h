@@ -0,0 +1,14 @@
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+} arena_block;
+
+struct arena {
+	arena_block *blocks; /* current block first */
+};
+
+arena_t *arena_alloc(void);
+void *arena_get(arena_t *arena, size_t size);  /* allocate memory (released with the arena) */
+void arena_reset(arena_t *arena);              /* release all allocations (keeps one block) */
+void arena_free(arena_t **arena);
@@ -207,6 +207,8 @@ int main(int argc, char *argv[]) {
 		else log_info("brain", ret, state);
 	}
 
+	db_model_node_log_stats("brain");
+
 	state = "db_disconnect";
 	ret = db_disconnect();
 	if (ret) goto fail;
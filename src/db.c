@@ -1,10 +1,12 @@
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "err.h"
 #include "types.h"
 #include "db.h"
 #include "megahal.h"
+#include "output.h"
 
 int db_brain_use(const char *brain, brain_t *ref) {
 	int ret;
@@ -19,22 +21,113 @@ int db_brain_use(const char *brain, brain_t *ref) {
 	return ret;
 }
 
-int db_word_use(const char *word, word_t *ref) {
+int db_word_use(const char *word, word_t *ref, uint8_t *flags) {
 	int ret;
 
 	WARN_IF(word == NULL);
 	WARN_IF(word[0] == 0);
 
-	ret = db_word_get(word, ref);
+	ret = db_word_get(word, ref, flags);
 	if (ret == -ENOTFOUND)
-		ret = db_word_add(word, ref);
+		ret = db_word_add(word, ref, flags);
 	return ret;
 }
 
+/*
+ * Nodes are allocated in slabs and recycled through a free list (linked
+ * using the nodes field) because most of them are only used briefly.
+ * The pool is not thread-safe; nodes are only used by the thread with
+ * the database connection.
+ */
+#define DB_TREE_SLAB 256
+
+typedef struct db_tree_slab {
+	struct db_tree_slab *next;
+	db_tree nodes[DB_TREE_SLAB];
+} db_tree_slab;
+
+static db_tree_slab *node_slabs = NULL;
+static db_tree *node_free_list = NULL;
+static uint64_t node_unused = 0; /* nodes at the end of the free list that have never been allocated */
+static db_tree_stats node_stats = { 0, 0, 0, 0 };
+
+static db_tree *node_pool_get(void) {
+	db_tree *node;
+
+	if (node_free_list == NULL) {
+		db_tree_slab *slab;
+		uint_fast32_t i;
+
+		slab = malloc(sizeof(db_tree_slab));
+		if (slab == NULL) return NULL;
+
+		slab->next = node_slabs;
+		node_slabs = slab;
+		node_stats.slabs++;
+
+		for (i = DB_TREE_SLAB; i > 0; i--) {
+			slab->nodes[i - 1].nodes = (void **)node_free_list;
+			node_free_list = &slab->nodes[i - 1];
+		}
+		node_unused = DB_TREE_SLAB;
+	}
+
+	/* freed nodes are put on the free list before the unused nodes */
+	if (node_stats.slabs * DB_TREE_SLAB - node_stats.in_use > node_unused)
+		node_stats.reused++;
+	else
+		node_unused--;
+
+	node = node_free_list;
+	node_free_list = (db_tree *)node->nodes;
+
+	node_stats.allocs++;
+	node_stats.in_use++;
+	return node;
+}
+
+static void node_pool_put(db_tree *node) {
+	node->nodes = (void **)node_free_list;
+	node_free_list = node;
+
+	node_stats.in_use--;
+}
+
+void db_model_node_stats(db_tree_stats *stats) {
+	*stats = node_stats;
+}
+
+void db_model_node_pool_free(void) {
+	if (node_stats.in_use > 0)
+		return;
+
+	while (node_slabs != NULL) {
+		db_tree_slab *slab = node_slabs;
+
+		node_slabs = slab->next;
+		free(slab);
+	}
+
+	node_free_list = NULL;
+	node_unused = 0;
+	node_stats.slabs = 0;
+}
+
+void db_model_node_log_stats(const char *name) {
+	db_tree_stats stats;
+	char msg[128];
+
+	db_model_node_stats(&stats);
+	snprintf(msg, sizeof(msg), "%llu nodes allocated, %llu from pool (%.1f%%)",
+		(unsigned long long int)stats.allocs, (unsigned long long int)stats.reused,
+		stats.allocs > 0 ? stats.reused * 100.0 / stats.allocs : 0.0);
+	log_info(name, OK, msg);
+}
+
 db_tree *db_model_node_alloc(void) {
 	db_tree *node;
 
-	node = malloc(sizeof(db_tree));
+	node = node_pool_get();
 	if (node == NULL) return NULL;
 
 	node->id = 0;
@@ -44,6 +137,7 @@ db_tree *db_model_node_alloc(void) {
 	node->count = 0;
 
 	node->children = 0;
+	node->capacity = 0;
 	node->nodes = NULL;
 
 	return node;
@@ -60,11 +154,12 @@ int db_model_node_clear(db_tree *node) {
 	node->usage = 0;
 	node->count = 0;
 
-	for (i = 0; i < node->children; i++)
-		db_model_node_free((db_tree **)&node->nodes[i++]);
+	for (i = 0; i < node->capacity; i++)
+		db_model_node_free((db_tree **)&node->nodes[i]);
 	free(node->nodes);
 
 	node->children = 0;
+	node->capacity = 0;
 	node->nodes = NULL;
 
 	return OK;
@@ -78,10 +173,10 @@ void db_model_node_free(db_tree **node) {
 
 	node_p = *node;
 
-	for (i = 0; i < node_p->children; i++)
-		db_model_node_free((db_tree **)&node_p->nodes[i++]);
+	for (i = 0; i < node_p->capacity; i++)
+		db_model_node_free((db_tree **)&node_p->nodes[i]);
 	free(node_p->nodes);
 
-	free(*node);
+	node_pool_put(node_p);
 	*node = NULL;
 }
@@ -1,3 +1,10 @@
+/*
+ * If SQLHAL_READ is set, reads from the model (node lookups, random
+ * nodes and the model's words) use that connection, which may be a hot
+ * standby. It only sees committed data and may lag behind the primary.
+ * Once anything has been written on the main connection, reads go to
+ * the main connection until the transaction is committed or rolled back.
+ */
 int db_connect(void);         /* creates tables, prepares statements */
 int db_disconnect(void);      /* deallocates prepared statements */
 
@@ -9,10 +16,17 @@ int db_brain_add(const char *brain, brain_t *ref);                           /*
 int db_brain_get(const char *brain, brain_t *ref);                           /* return -ENOTFOUND if brain does not exist */
 int db_brain_use(const char *brain, brain_t *ref);                           /* get or add brain */
 
-int db_word_add(const char *word, word_t *ref);                              /* add word (does not exist) */
-int db_word_get(const char *word, word_t *ref);                              /* return -ENOTFOUND if word does not exist */
-int db_word_use(const char *word, word_t *ref);                              /* get or add word */
+#define DB_WORD_F_ALNUM 0x01 /* starts with an alphanumeric character */
+#define DB_WORD_F_TERM  0x02 /* ends with a sentence terminator */
+
+int db_word_add(const char *word, word_t *ref, uint8_t *flags);              /* add word (does not exist), flags may be NULL */
+int db_word_get(const char *word, word_t *ref, uint8_t *flags);              /* return -ENOTFOUND if word does not exist */
+int db_word_use(const char *word, word_t *ref, uint8_t *flags);              /* get or add word */
 int db_word_str(word_t ref, char **word);                                    /* convert word to string */
+int db_word_strs(const list_t *words,
+	int (*allocate)(void *data, number_t length),
+	int (*callback)(void *data, const char *word, size_t len),
+	void *data);                                                           /* convert list of words to strings (in one batch) */
 
 int db_list_zap(brain_t brain, enum list type);                              /* clears table */
 int db_list_add(brain_t brain, enum list type, word_t word);                 /* add word (does not exist) */
@@ -38,6 +52,7 @@ typedef struct {
 	number_t count;
 
 	number_t children;
+	number_t capacity;
 	void **nodes;
 } db_tree;
 
@@ -48,18 +63,56 @@ int db_model_set_order(brain_t brain, number_t order);                       /*
 int db_model_get_root(brain_t brain, db_tree **forward, db_tree **backward); /* get or create forward/backward nodes */
 db_tree *db_model_node_alloc(void);                                          /* allocate node for creation on first update */
 int db_model_create(brain_t brain, db_tree **node);                          /* create node */
-int db_model_update(brain_t brain, db_tree *node);                           /* update node */
+int db_model_update(brain_t brain, db_tree *node);                           /* update usage/count of root node */
 int db_model_link(db_tree *parent, db_tree *child);                          /* add node to tree */
-int db_model_node_fill(brain_t brain, db_tree *node);                        /* load children */
+int db_model_use(brain_t brain, db_tree **contexts, number_t size, word_t word); /* add 1 to usage of contexts[i - 1] and count of its child node for word, which replaces contexts[i] */
+int db_model_node_fill(brain_t brain, db_tree *node);                        /* load children, unordered (re-using previously allocated child nodes) */
 int db_model_node_find(brain_t brain, db_tree *tree, word_t word, db_tree **found); /* find node */
 int db_model_node_clear(db_tree *node);                                      /* clear data in node for re-use */
 void db_model_node_free(db_tree **node);                                     /* free node data (recursively) */
+
+typedef struct {
+	uint64_t allocs; /* nodes allocated */
+	uint64_t reused; /* nodes allocated from the free list */
+	uint64_t slabs;  /* slabs of nodes currently allocated */
+	uint64_t in_use; /* nodes currently allocated */
+} db_tree_stats;
+
+void db_model_node_stats(db_tree_stats *stats);                              /* get node pool statistics */
+void db_model_node_log_stats(const char *name);                              /* log node pool statistics */
+void db_model_node_pool_free(void);                                          /* release node pool memory (if no nodes are in use) */
+
 int db_model_contains(brain_t brain, word_t word);                           /* return -ENOTFOUND if word does not exist in this brain's model */
 int db_model_rand_word(brain_t brain, const db_tree *node, word_t *word);    /* find a random word in the node's children or return -ENOTFOUND */
 int db_model_rand_node(brain_t brain, const db_tree *parent, db_tree **node); /* find a random node in the parent's children or return -ENOTFOUND */
 int db_model_next_node(brain_t brain, const db_tree *current, db_tree **next); /* find the next node in the parent's children (in a never-ending cycle) or return -ENOTFOUND */
 
+typedef struct {
+	number_t parent; /* index of parent node */
+	number_t depth;  /* 0 for root nodes */
+	word_t word;
+	number_t usage;
+	number_t count;
+} db_merge_node;
+
+int db_model_merge(brain_t brain, const db_merge_node *nodes, number_t size,
+	number_t forward, number_t backward);                                  /* add usage/count of nodes (parents first) to the model */
+
+int db_model_load_begin(brain_t brain);                                      /* start staging new nodes for an empty model */
+int db_model_load_node(brain_t brain, db_tree *node);                        /* stage new node (assigns id, parent must be staged first) */
+int db_model_load_end(brain_t brain);                                        /* add staged nodes to the model */
+void db_model_load_abort(void);                                              /* discard staged nodes (transaction must be rolled back) */
+
 int db_model_dump_words(brain_t brain,
 	int (*allocate)(void *data, number_t size),
 	int (*callback)(void *data, word_t word, number_t pos, const char *text),
 	void *data);                                                           /* iterate through all words */
+
+#define DB_KEYWORD_F_BAN   0x01
+#define DB_KEYWORD_F_AUX   0x02
+#define DB_KEYWORD_F_MODEL 0x04
+#define DB_KEYWORD_F_ALNUM 0x08
+
+int db_model_keywords(brain_t brain, const list_t *words,
+	int (*callback)(void *data, word_t word, uint8_t flags),
+	void *data);                                                           /* swap each word and return its keyword flags (in one batch) */
@@ -18,6 +18,7 @@ int db_brain_add(const char *brain, brain_t *ref) {
 
 	if (brain == NULL || ref == NULL) return -EINVAL;
 	if (db_connect()) return -EDB;
+	conn_written = 1;
 
 	param[0] = brain;
 	res = PQexecPrepared(conn, "brain_add", 1, param, NULL, NULL, 1);
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,11 +9,122 @@
 #include "err.h"
 #include "types.h"
 #include "db.h"
+#include "dict.h"
 #include "output.h"
 
 #include "db_postgres.h"
 
 PGconn *conn = NULL;
+PGconn *conn_read = NULL;
+int conn_written = 0;
+int nodes_partitioned = 0;
+
+/* calculate DB_WORD_F_* flags for a word */
+#define WORD_FLAGS(word) "((CASE WHEN " word " ~ '^[A-Za-z0-9]' THEN 1 ELSE 0 END)"\
+	" | (CASE WHEN " word " ~ '[!.?]$' THEN 2 ELSE 0 END))"
+
+/*
+ * Prepare the statements that only read from the model, on the main
+ * connection and on the read connection (which may be a hot standby).
+ * Returns the failed result (or NULL on success).
+ */
+static PGresult *db_prepare_reads(PGconn *c) {
+	PGresult *res;
+
+	res = PQprepare(c, "model_node_get", "SELECT id, word, usage, count FROM nodes"\
+		" WHERE brain = $1 AND (id = $2 OR parent = $2)", 2, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	res = PQprepare(c, "model_node_find", "SELECT id, word, usage, count FROM nodes"\
+		" WHERE brain = $1 AND parent = $2 AND word = $3", 3, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	res = PQprepare(c, "model_node_find_fin", "SELECT id, word, usage, count FROM nodes"\
+		" WHERE brain = $1 AND parent = $2 AND word IS NULL", 2, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	res = PQprepare(c, "model_word_random", "SELECT word FROM nodes WHERE brain = $1 AND parent = $2"\
+		" ORDER BY random() LIMIT 1", 2, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	res = PQprepare(c, "model_node_random", "SELECT id, word, usage, count FROM nodes"\
+		" WHERE brain = $1 AND parent = $2"\
+		" ORDER BY random() LIMIT 1", 2, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	res = PQprepare(c, "model_node_first", "SELECT id, parent, word, usage, count FROM nodes"\
+		" WHERE brain = $1 AND parent = $2"\
+		" ORDER BY id LIMIT 1", 2, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	res = PQprepare(c, "model_node_prev", "SELECT id, parent, word, usage, count FROM nodes"\
+		" WHERE brain = $1 AND parent = $2 AND id < $3"\
+		" ORDER BY id DESC LIMIT 1", 3, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	res = PQprepare(c, "model_node_next", "SELECT id, parent, word, usage, count FROM nodes"\
+		" WHERE brain = $1 AND parent = $2 AND id > $3"\
+		" ORDER BY id LIMIT 1", 3, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	res = PQprepare(c, "model_node_last", "SELECT id, parent, word, usage, count FROM nodes"\
+		" WHERE brain = $1 AND parent = $2"\
+		" ORDER BY id DESC LIMIT 1", 2, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	res = PQprepare(c, "model_words", "SELECT word FROM brain_words WHERE brain = $1", 1, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) return res;
+	PQclear(res);
+
+	return NULL;
+}
+
+/*
+ * Replies only read from the model, so those statements can be sent to
+ * a separate connection (e.g. a hot standby) given by SQLHAL_READ.
+ * Otherwise the main connection is used for everything.
+ */
+static int db_connect_read(void) {
+	const char *conninfo = getenv("SQLHAL_READ");
+	PGresult *res;
+
+	if (conninfo == NULL || conninfo[0] == 0) {
+		conn_read = conn;
+		return OK;
+	}
+
+	conn_read = PQconnectdb(conninfo);
+	if (conn_read == NULL)
+		return -EDB;
+
+	if (PQstatus(conn_read) != CONNECTION_OK) {
+		log_error("DB", PQstatus(conn_read), PQerrorMessage(conn_read));
+		goto fail;
+	}
+
+	res = db_prepare_reads(conn_read);
+	if (res != NULL) {
+		log_error("db_connect_read", PQresultStatus(res), PQresultErrorMessage(res));
+		PQclear(res);
+		goto fail;
+	}
+
+	return OK;
+
+fail:
+	PQfinish(conn_read);
+	conn_read = NULL;
+	return -EDB;
+}
 
 int db_connect(void) {
 	if (conn == NULL) {
@@ -29,16 +141,21 @@ int db_connect(void) {
 			PGresult *res = NULL;
 			const char *brains[] = { "brains" };
 			const char *words[] = { "words" };
+			const char *words_flags[] = { "words", "flags" };
 			const char *lists[] = { "lists" };
 			const char *maps[] = { "maps" };
 			const char *models[] = { "models" };
 			const char *nodes[] = { "nodes" };
+			const char *nodes_find[] = { "nodes_find" };
+			const char *nodes_order[] = { "nodes_order" };
+			const char *nodes_fin[] = { "nodes_fin" };
+			const char *brain_words[] = { "brain_words" };
 			int nodes_created = 0;
 			int server_ver;
 
 			server_ver = PQserverVersion(conn);
-			if (server_ver < 80400) {
-				log_error("DB", server_ver, "Server version must be 8.4.0+");
+			if (server_ver < 90500) {
+				log_error("DB", server_ver, "Server version must be 9.5.0+");
 				PQfinish(conn);
 				conn = NULL;
 				return -EDB;
@@ -50,6 +167,20 @@ int db_connect(void) {
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
+			res = PQprepare(conn, "table_partitioned", "SELECT relname FROM pg_class, pg_namespace"\
+				" WHERE pg_namespace.oid = pg_class.relnamespace AND nspname = 'public' AND relname = $1 AND relkind = 'p'", 1, NULL);
+			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+			PQclear(res);
+
+			res = PQprepare(conn, "index_exists", "SELECT indexname FROM pg_indexes WHERE schemaname = 'public' AND indexname = $1", 1, NULL);
+			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+			PQclear(res);
+
+			res = PQprepare(conn, "column_exists", "SELECT column_name FROM information_schema.columns"\
+				" WHERE table_schema = 'public' AND table_name = $1 AND column_name = $2", 2, NULL);
+			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+			PQclear(res);
+
 			/* BRAIN */
 
 			res = PQexecPrepared(conn, "table_exists", 1, brains, NULL, NULL, 1);
@@ -71,13 +202,27 @@ int db_connect(void) {
 			if (PQntuples(res) != 1) {
 				PQclear(res);
 
-				res = PQexec(conn, "CREATE TABLE words (id SERIAL UNIQUE, word TEXT, added TIMESTAMP NOT NULL DEFAULT NOW(),"\
+				res = PQexec(conn, "CREATE TABLE words (id SERIAL UNIQUE, word TEXT, added TIMESTAMP NOT NULL DEFAULT NOW(), flags INT NOT NULL DEFAULT 0,"\
 					" PRIMARY KEY (word),"\
 					" CONSTRAINT valid_id CHECK (id > 0))");
 				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			}
 			PQclear(res);
 
+			res = PQexecPrepared(conn, "column_exists", 2, words_flags, NULL, NULL, 1);
+			if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+			if (PQntuples(res) != 1) {
+				PQclear(res);
+
+				res = PQexec(conn, "ALTER TABLE words ADD COLUMN flags INT NOT NULL DEFAULT 0");
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+				PQclear(res);
+
+				res = PQexec(conn, "UPDATE words SET flags = " WORD_FLAGS("word"));
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+			}
+			PQclear(res);
+
 			/* LIST */
 
 			res = PQexecPrepared(conn, "table_exists", 1, lists, NULL, NULL, 1);
@@ -125,31 +270,154 @@ int db_connect(void) {
 
 			/* MODEL */
 
+			/*
+			 * On 11.0+ the nodes are partitioned by brain (one partition
+			 * per model) so that a brain can be zapped by dropping its
+			 * partition. The unique constraints of a partitioned table
+			 * must include the brain, so the nodes can't be referenced
+			 * by id (from themselves or the models).
+			 */
 			res = PQexecPrepared(conn, "table_exists", 1, nodes, NULL, NULL, 1);
 			if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
 			if (PQntuples(res) != 1) {
 				PQclear(res);
 
-				res = PQexec(conn, "CREATE TABLE nodes (id BIGSERIAL UNIQUE, brain BIGINT NOT NULL, parent BIGINT, word BIGINT, usage BIGINT NOT NULL, count BIGINT NOT NULL,"\
-					" PRIMARY KEY (brain, id),"\
-					" FOREIGN KEY (parent) REFERENCES nodes (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
-					" FOREIGN KEY (word) REFERENCES words (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
-					" CONSTRAINT valid_id CHECK (id > 0),"\
-					" CONSTRAINT valid_usage CHECK (usage >= 0),"\
-					" CONSTRAINT valid_count CHECK (count >= 0),"\
-					" CONSTRAINT valid_root CHECK (parent IS NOT NULL OR word IS NULL),"\
-					" CONSTRAINT valid_fin CHECK (parent IS NULL OR word IS NOT NULL OR usage = 0))");
+				if (server_ver >= 110000) {
+					res = PQexec(conn, "CREATE TABLE nodes (id BIGSERIAL, brain BIGINT NOT NULL, parent BIGINT, word BIGINT, usage BIGINT NOT NULL, count BIGINT NOT NULL,"\
+						" PRIMARY KEY (brain, id),"\
+						" FOREIGN KEY (word) REFERENCES words (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
+						" CONSTRAINT valid_id CHECK (id > 0),"\
+						" CONSTRAINT valid_usage CHECK (usage >= 0),"\
+						" CONSTRAINT valid_count CHECK (count >= 0),"\
+						" CONSTRAINT valid_root CHECK (parent IS NOT NULL OR word IS NULL),"\
+						" CONSTRAINT valid_fin CHECK (parent IS NULL OR word IS NOT NULL OR usage = 0))"\
+						" PARTITION BY LIST (brain)");
+					if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+					PQclear(res);
+
+					res = PQexec(conn, "CREATE UNIQUE INDEX nodes_child ON nodes (brain, parent, word)");
+					if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+					PQclear(res);
+
+					nodes_partitioned = 1;
+				} else {
+					res = PQexec(conn, "CREATE TABLE nodes (id BIGSERIAL UNIQUE, brain BIGINT NOT NULL, parent BIGINT, word BIGINT, usage BIGINT NOT NULL, count BIGINT NOT NULL,"\
+						" PRIMARY KEY (brain, id),"\
+						" FOREIGN KEY (parent) REFERENCES nodes (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
+						" FOREIGN KEY (word) REFERENCES words (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
+						" CONSTRAINT valid_id CHECK (id > 0),"\
+						" CONSTRAINT valid_usage CHECK (usage >= 0),"\
+						" CONSTRAINT valid_count CHECK (count >= 0),"\
+						" CONSTRAINT valid_root CHECK (parent IS NOT NULL OR word IS NULL),"\
+						" CONSTRAINT valid_fin CHECK (parent IS NULL OR word IS NOT NULL OR usage = 0))");
+					if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+					PQclear(res);
+
+					res = PQexec(conn, "CREATE UNIQUE INDEX nodes_child ON nodes (parent, word)");
+					if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+					PQclear(res);
+
+					nodes_partitioned = 0;
+				}
+
+				res = PQexec(conn, "CREATE INDEX nodes_words ON nodes (word)");
 				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+
+				nodes_created = 1;
+			} else {
 				PQclear(res);
 
-				res = PQexec(conn, "CREATE INDEX nodes_words ON nodes (word)");
+				res = PQexecPrepared(conn, "table_partitioned", 1, nodes, NULL, NULL, 1);
+				if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+				nodes_partitioned = PQntuples(res) == 1;
+			}
+			PQclear(res);
+
+			/*
+			 * Covering indexes so that finding a child node and
+			 * iterating through the children of a node can use
+			 * index-only scans (INCLUDE requires 11.0+).
+			 */
+			res = PQexecPrepared(conn, "index_exists", 1, nodes_find, NULL, NULL, 1);
+			if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+			if (PQntuples(res) != 1) {
+				PQclear(res);
+
+				if (server_ver >= 110000)
+					res = PQexec(conn, "CREATE INDEX nodes_find ON nodes (parent, word, brain) INCLUDE (id, usage, count)");
+				else
+					res = PQexec(conn, "CREATE INDEX nodes_find ON nodes (parent, word, brain, id, usage, count)");
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+			}
+			PQclear(res);
+
+			res = PQexecPrepared(conn, "index_exists", 1, nodes_order, NULL, NULL, 1);
+			if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+			if (PQntuples(res) != 1) {
+				PQclear(res);
+
+				if (server_ver >= 110000)
+					res = PQexec(conn, "CREATE INDEX nodes_order ON nodes (parent, brain, id) INCLUDE (word, usage, count)");
+				else
+					res = PQexec(conn, "CREATE INDEX nodes_order ON nodes (parent, brain, id, word, usage, count)");
 				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+			}
+			PQclear(res);
+
+			/*
+			 * Node ids are reserved in blocks (so that they can be
+			 * assigned before inserting), each value of nodes_block_seq
+			 * is the number of a block of NODE_ID_BLOCK ids. The first
+			 * block starts after every id from nodes_id_seq.
+			 */
+			res = PQexec(conn, "SELECT relname FROM pg_class WHERE relkind = 'S' AND relname = 'nodes_block_seq'");
+			if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+			if (PQntuples(res) != 1) {
+				char command[128];
+
 				PQclear(res);
 
-				res = PQexec(conn, "CREATE UNIQUE INDEX nodes_child ON nodes (parent, word)");
+				res = PQexec(conn, "CREATE SEQUENCE nodes_block_seq");
 				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+				PQclear(res);
 
-				nodes_created = 1;
+				snprintf(command, sizeof(command), "SELECT setval('nodes_block_seq', (last_value + %u) / %u + 1, false) FROM nodes_id_seq",
+					NODE_ID_BLOCK, NODE_ID_BLOCK);
+				res = PQexec(conn, command);
+				if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+			}
+			PQclear(res);
+
+			/*
+			 * There can only be one FIN node for each parent (so that it
+			 * can be upserted), but it has no word so nodes_child can't
+			 * enforce this. Merge any duplicates created by previous
+			 * versions before adding the index.
+			 */
+			res = PQexecPrepared(conn, "index_exists", 1, nodes_fin, NULL, NULL, 1);
+			if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+			if (PQntuples(res) != 1) {
+				PQclear(res);
+
+				res = PQexec(conn, "UPDATE nodes SET count = fin.count FROM"\
+					" (SELECT MIN(id) AS id, SUM(count) AS count FROM nodes WHERE parent IS NOT NULL AND word IS NULL"\
+						" GROUP BY parent HAVING COUNT(*) > 1) AS fin"\
+					" WHERE nodes.id = fin.id");
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+				PQclear(res);
+
+				res = PQexec(conn, "DELETE FROM nodes USING"\
+					" (SELECT parent, MIN(id) AS id FROM nodes WHERE parent IS NOT NULL AND word IS NULL"\
+						" GROUP BY parent HAVING COUNT(*) > 1) AS fin"\
+					" WHERE nodes.parent = fin.parent AND nodes.word IS NULL AND nodes.id <> fin.id");
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+				PQclear(res);
+
+				if (nodes_partitioned)
+					res = PQexec(conn, "CREATE UNIQUE INDEX nodes_fin ON nodes (brain, parent) WHERE word IS NULL");
+				else
+					res = PQexec(conn, "CREATE UNIQUE INDEX nodes_fin ON nodes (parent) WHERE word IS NULL");
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			}
 			PQclear(res);
 
@@ -158,12 +426,19 @@ int db_connect(void) {
 			if (PQntuples(res) != 1) {
 				PQclear(res);
 
-				res = PQexec(conn, "CREATE TABLE models (brain BIGINT NOT NULL, contexts BIGINT NOT NULL, forward BIGINT, backward BIGINT,"\
-					" PRIMARY KEY (brain),"\
-					" FOREIGN KEY (brain) REFERENCES brains (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
-					" FOREIGN KEY (forward) REFERENCES nodes (id),"\
-					" FOREIGN KEY (backward) REFERENCES nodes (id),"\
-					" CONSTRAINT valid_order CHECK (contexts >= 0))");
+				if (nodes_partitioned) {
+					res = PQexec(conn, "CREATE TABLE models (brain BIGINT NOT NULL, contexts BIGINT NOT NULL, forward BIGINT, backward BIGINT,"\
+						" PRIMARY KEY (brain),"\
+						" FOREIGN KEY (brain) REFERENCES brains (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
+						" CONSTRAINT valid_order CHECK (contexts >= 0))");
+				} else {
+					res = PQexec(conn, "CREATE TABLE models (brain BIGINT NOT NULL, contexts BIGINT NOT NULL, forward BIGINT, backward BIGINT,"\
+						" PRIMARY KEY (brain),"\
+						" FOREIGN KEY (brain) REFERENCES brains (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
+						" FOREIGN KEY (forward) REFERENCES nodes (id),"\
+						" FOREIGN KEY (backward) REFERENCES nodes (id),"\
+						" CONSTRAINT valid_order CHECK (contexts >= 0))");
+				}
 				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			}
 			PQclear(res);
@@ -175,6 +450,35 @@ int db_connect(void) {
 				PQclear(res);
 			}
 
+			/*
+			 * The words used by each brain's nodes (with the number of
+			 * nodes using them) so that the vocabulary can be read
+			 * without scanning the whole model. This is maintained as
+			 * nodes are created and the brain is zapped.
+			 */
+			res = PQexecPrepared(conn, "table_exists", 1, brain_words, NULL, NULL, 1);
+			if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+			if (PQntuples(res) != 1) {
+				PQclear(res);
+
+				res = PQexec(conn, "CREATE TABLE brain_words (brain BIGINT NOT NULL, word BIGINT NOT NULL, refcount BIGINT NOT NULL,"\
+					" PRIMARY KEY (brain, word),"\
+					" FOREIGN KEY (brain) REFERENCES brains (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
+					" FOREIGN KEY (word) REFERENCES words (id) ON UPDATE CASCADE ON DELETE CASCADE,"\
+					" CONSTRAINT valid_refcount CHECK (refcount > 0))");
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+				PQclear(res);
+
+				res = PQexec(conn, "CREATE INDEX brain_words_words ON brain_words (word)");
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+				PQclear(res);
+
+				res = PQexec(conn, "INSERT INTO brain_words (brain, word, refcount)"\
+					" SELECT brain, word, COUNT(*) FROM nodes WHERE word IS NOT NULL GROUP BY brain, word");
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+			}
+			PQclear(res);
+
 			/* BRAIN */
 
 			res = PQprepare(conn, "brain_add", "INSERT INTO brains (name) VALUES($1)", 1, NULL);
@@ -191,19 +495,21 @@ int db_connect(void) {
 
 			/* WORD */
 
-			res = PQprepare(conn, "word_add", "INSERT INTO words (word) VALUES($1)", 1, NULL);
+			res = PQprepare(conn, "word_add", "INSERT INTO words (word, flags) VALUES($1, " WORD_FLAGS("$1") ")"\
+				" ON CONFLICT (word) DO UPDATE SET flags = words.flags RETURNING id, flags", 1, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "word_add_id", "SELECT currval('words_id_seq')", 0, NULL);
+			res = PQprepare(conn, "word_get", "SELECT id, flags FROM words WHERE word = $1", 1, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "word_get", "SELECT id FROM words WHERE word = $1", 1, NULL);
+			res = PQprepare(conn, "word_str", "SELECT word FROM words WHERE id = $1", 1, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "word_str", "SELECT word FROM words WHERE id = $1", 1, NULL);
+			res = PQprepare(conn, "word_strs", "SELECT words.word FROM generate_subscripts($1::BIGINT[], 1) AS pos, words"\
+				" WHERE words.id = ($1::BIGINT[])[pos] ORDER BY pos", 1, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
@@ -266,23 +572,15 @@ int db_connect(void) {
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_create", "INSERT INTO nodes (brain, usage, count) VALUES($1, 0, 0)", 1, NULL);
+			res = PQprepare(conn, "model_create", "INSERT INTO nodes (id, brain, usage, count) VALUES($1, $2, 0, 0)", 2, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_fastcreate", "INSERT INTO nodes (brain, usage, count, word, parent) VALUES($1, $2, $3, $4, $5)", 5, NULL);
+			res = PQprepare(conn, "model_reserve_ids", "SELECT nextval('nodes_block_seq')", 0, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_create_id", "SELECT currval('nodes_id_seq')", 0, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
-
-			res = PQprepare(conn, "model_rootupdate", "UPDATE nodes SET parent = NULL, usage = $2, count = $3 WHERE id = $1", 3, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
-
-			res = PQprepare(conn, "model_update", "UPDATE nodes SET usage = $2, count = $3 WHERE id = $1", 3, NULL);
+			res = PQprepare(conn, "model_rootupdate", "UPDATE nodes SET parent = NULL, usage = $2, count = $3 WHERE id = $1 AND brain = $4", 4, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
@@ -290,62 +588,79 @@ int db_connect(void) {
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_root_set", "UPDATE models SET forward = $2, backward = $3 WHERE brain = $1", 3, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
-
-			res = PQprepare(conn, "model_node_get", "SELECT id, word, usage, count FROM nodes"\
-				" WHERE brain = $1 AND (id = $2 OR parent = $2)"\
-				" ORDER BY (SELECT words.word FROM words WHERE words.id = nodes.word) NULLS LAST", 2, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
-
-			res = PQprepare(conn, "model_node_find", "SELECT id, word, usage, count FROM nodes"\
-				" WHERE brain = $1 AND parent = $2 AND word = $3", 3, NULL);
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-			PQclear(res);
+			res = db_prepare_reads(conn);
+			if (res != NULL) goto fail;
 
-			res = PQprepare(conn, "model_word_exists", "SELECT word FROM nodes WHERE brain = $1 AND word = $2 LIMIT 1", 2, NULL);
+			res = PQprepare(conn, "model_root_set", "UPDATE models SET forward = $2, backward = $3 WHERE brain = $1", 3, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_word_random", "SELECT word FROM nodes WHERE brain = $1 AND parent = $2"\
-				" ORDER BY random() LIMIT 1", 2, NULL);
+			/*
+			 * Add a use of a word (or FIN) after each of the contexts
+			 * ($2), creating the nodes with the ids in $3 if necessary.
+			 * Rows are locked in order of parent so that two statements
+			 * can't deadlock each other. The child nodes stay locked
+			 * until the transaction ends, so learners using the same
+			 * contexts (e.g. the same first word) still wait for each
+			 * other.
+			 */
+			if (nodes_partitioned) {
+				res = PQprepare(conn, "model_use", "INSERT INTO nodes (id, brain, parent, word, usage, count)"\
+					" SELECT input.id, $1::BIGINT, input.parent, $4::BIGINT, 0, 1 FROM unnest($2::BIGINT[], $3::BIGINT[]) AS input (parent, id) ORDER BY input.parent"\
+					" ON CONFLICT (brain, parent, word) DO UPDATE SET count = nodes.count + 1 RETURNING id, parent, usage, count", 4, NULL);
+			} else {
+				res = PQprepare(conn, "model_use", "INSERT INTO nodes (id, brain, parent, word, usage, count)"\
+					" SELECT input.id, $1::BIGINT, input.parent, $4::BIGINT, 0, 1 FROM unnest($2::BIGINT[], $3::BIGINT[]) AS input (parent, id) ORDER BY input.parent"\
+					" ON CONFLICT (parent, word) DO UPDATE SET count = nodes.count + 1 RETURNING id, parent, usage, count", 4, NULL);
+			}
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_node_random", "SELECT id, word, usage, count FROM nodes"\
-				" WHERE brain = $1 AND parent = $2"\
-				" ORDER BY random() LIMIT 1", 2, NULL);
+			if (nodes_partitioned) {
+				res = PQprepare(conn, "model_use_fin", "INSERT INTO nodes (id, brain, parent, usage, count)"\
+					" SELECT input.id, $1::BIGINT, input.parent, 0, 1 FROM unnest($2::BIGINT[], $3::BIGINT[]) AS input (parent, id) ORDER BY input.parent"\
+					" ON CONFLICT (brain, parent) WHERE word IS NULL DO UPDATE SET count = nodes.count + 1 RETURNING id, parent, usage, count", 3, NULL);
+			} else {
+				res = PQprepare(conn, "model_use_fin", "INSERT INTO nodes (id, brain, parent, usage, count)"\
+					" SELECT input.id, $1::BIGINT, input.parent, 0, 1 FROM unnest($2::BIGINT[], $3::BIGINT[]) AS input (parent, id) ORDER BY input.parent"\
+					" ON CONFLICT (parent) WHERE word IS NULL DO UPDATE SET count = nodes.count + 1 RETURNING id, parent, usage, count", 3, NULL);
+			}
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_node_first", "SELECT id, parent, word, usage, count FROM nodes"\
-				" WHERE brain = $1 AND parent = $2"\
-				" ORDER BY id LIMIT 1", 2, NULL);
+			/*
+			 * Add the uses ($3) of the contexts ($2) just before commit,
+			 * locking them in order of id.
+			 */
+			res = PQprepare(conn, "model_use_context", "UPDATE nodes SET usage = nodes.usage + locked.uses"\
+				" FROM (SELECT nodes.id, input.uses FROM nodes, unnest($2::BIGINT[], $3::BIGINT[]) AS input (id, uses)"\
+					" WHERE nodes.brain = $1 AND nodes.id = input.id ORDER BY nodes.id FOR UPDATE OF nodes) AS locked"\
+				" WHERE nodes.brain = $1 AND nodes.id = locked.id", 3, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_node_prev", "SELECT id, parent, word, usage, count FROM nodes"\
-				" WHERE brain = $1 AND parent = $2 AND id < $3"\
-				" ORDER BY id DESC LIMIT 1", 3, NULL);
+			res = PQprepare(conn, "model_brain_words", "SELECT words.id, ROW_NUMBER() OVER (ORDER BY words.id) - 1, words.word"\
+				" FROM brain_words, words WHERE brain_words.brain = $1 AND words.id = brain_words.word ORDER BY words.word", 1, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_node_next", "SELECT id, parent, word, usage, count FROM nodes"\
-				" WHERE brain = $1 AND parent = $2 AND id > $3"\
-				" ORDER BY id LIMIT 1", 3, NULL);
+			res = PQprepare(conn, "brain_word_use", "INSERT INTO brain_words (brain, word, refcount) VALUES($1, $2, $3)"\
+				" ON CONFLICT (brain, word) DO UPDATE SET refcount = brain_words.refcount + EXCLUDED.refcount", 3, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_node_last", "SELECT id, parent, word, usage, count FROM nodes"\
-				" WHERE brain = $1 AND parent = $2"\
-				" ORDER BY id DESC LIMIT 1", 2, NULL);
+			res = PQprepare(conn, "brain_words_zap", "DELETE FROM brain_words WHERE brain = $1", 1, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
-			res = PQprepare(conn, "model_brain_words", "SELECT id, ROW_NUMBER() OVER (ORDER BY id) - 1, word "\
-				" FROM words WHERE id IN (SELECT word FROM nodes WHERE brain=$1) ORDER BY word", 1, NULL);
+			res = PQprepare(conn, "model_keywords", "SELECT input.word,"\
+				" EXISTS (SELECT 1 FROM lists WHERE brain = $1 AND type = 2 AND word = input.word),"\
+				" EXISTS (SELECT 1 FROM lists WHERE brain = $1 AND type = 1 AND word = input.word),"\
+				" EXISTS (SELECT 1 FROM brain_words WHERE brain = $1 AND word = input.word),"\
+				" (words.flags & 1) <> 0"\
+				" FROM (SELECT pos, COALESCE((SELECT value FROM maps WHERE brain = $1 AND type = 4 AND key = ($2::BIGINT[])[pos]),"\
+					" ($2::BIGINT[])[pos]) AS word FROM generate_subscripts($2::BIGINT[], 1) AS pos) AS input, words"\
+				" WHERE words.id = input.word ORDER BY input.pos", 2, NULL);
 			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 			PQclear(res);
 
@@ -353,6 +668,8 @@ int db_connect(void) {
 
 			if(db_commit()) goto fail2;
 
+			if (db_connect_read()) goto fail2;
+
 fail:
 			if (res != NULL) {
 				log_error("db_connect", PQresultStatus(res), PQresultErrorMessage(res));
@@ -392,15 +709,15 @@ int db_disconnect(void) {
 	res = PQexec(conn, "DEALLOCATE PREPARE word_add");
 	PQclear(res);
 
-	res = PQexec(conn, "DEALLOCATE PREPARE word_add_id");
-	PQclear(res);
-
 	res = PQexec(conn, "DEALLOCATE PREPARE word_get");
 	PQclear(res);
 
 	res = PQexec(conn, "DEALLOCATE PREPARE word_str");
 	PQclear(res);
 
+	res = PQexec(conn, "DEALLOCATE PREPARE word_strs");
+	PQclear(res);
+
 	/* LIST */
 
 	res = PQexec(conn, "DEALLOCATE PREPARE list_get");
@@ -446,18 +763,12 @@ int db_disconnect(void) {
 	res = PQexec(conn, "DEALLOCATE PREPARE model_create");
 	PQclear(res);
 
-	res = PQexec(conn, "DEALLOCATE PREPARE model_fastcreate");
-	PQclear(res);
-
-	res = PQexec(conn, "DEALLOCATE PREPARE model_create_id");
+	res = PQexec(conn, "DEALLOCATE PREPARE model_reserve_ids");
 	PQclear(res);
 
 	res = PQexec(conn, "DEALLOCATE PREPARE model_rootupdate");
 	PQclear(res);
 
-	res = PQexec(conn, "DEALLOCATE PREPARE model_update");
-	PQclear(res);
-
 	res = PQexec(conn, "DEALLOCATE PREPARE model_root_get");
 	PQclear(res);
 
@@ -470,7 +781,19 @@ int db_disconnect(void) {
 	res = PQexec(conn, "DEALLOCATE PREPARE model_node_find");
 	PQclear(res);
 
-	res = PQexec(conn, "DEALLOCATE PREPARE model_word_exists");
+	res = PQexec(conn, "DEALLOCATE PREPARE model_node_find_fin");
+	PQclear(res);
+
+	res = PQexec(conn, "DEALLOCATE PREPARE model_use");
+	PQclear(res);
+
+	res = PQexec(conn, "DEALLOCATE PREPARE model_use_fin");
+	PQclear(res);
+
+	res = PQexec(conn, "DEALLOCATE PREPARE model_use_context");
+	PQclear(res);
+
+	res = PQexec(conn, "DEALLOCATE PREPARE model_words");
 	PQclear(res);
 
 	res = PQexec(conn, "DEALLOCATE PREPARE model_word_random");
@@ -494,8 +817,26 @@ int db_disconnect(void) {
 	res = PQexec(conn, "DEALLOCATE PREPARE model_brain_words");
 	PQclear(res);
 
+	res = PQexec(conn, "DEALLOCATE PREPARE brain_word_use");
+	PQclear(res);
+
+	res = PQexec(conn, "DEALLOCATE PREPARE brain_words_zap");
+	PQclear(res);
+
+	res = PQexec(conn, "DEALLOCATE PREPARE model_keywords");
+	PQclear(res);
+
+	if (conn_read != conn)
+		PQfinish(conn_read);
+	conn_read = NULL;
+	conn_written = 0;
+
 	PQfinish(conn);
 	conn = NULL;
+
+	db_model_words_reset();
+	db_model_use_reset();
+	db_model_node_pool_free();
 	return OK;
 }
 
@@ -504,6 +845,9 @@ int db_begin(void) {
 
 	if (db_connect()) return -EDB;
 
+	/* other learners may have added words to the model */
+	db_model_words_reset();
+
 	res = PQexec(conn, "BEGIN");
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 	PQclear(res);
@@ -517,13 +861,19 @@ fail:
 
 int db_commit(void) {
 	PGresult *res;
+	int ret;
 
 	if (db_connect()) return -EDB;
 
+	ret = db_model_use_flush();
+	if (ret) return ret;
+
 	res = PQexec(conn, "COMMIT");
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 	PQclear(res);
 
+	conn_written = 0;
+
 	return OK;
 
 fail:
@@ -536,13 +886,52 @@ int db_rollback(void) {
 
 	if (db_connect()) return -EDB;
 
+	/* words added to the model may have been rolled back */
+	db_model_words_reset();
+	db_model_use_reset();
+
 	res = PQexec(conn, "ROLLBACK");
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 	PQclear(res);
 
+	conn_written = 0;
+
 	return OK;
 
 fail:
 	PQclear(res);
 	return -EDB;
 }
+
+int db_array_param(const list_t *words, char **param) {
+	uint_fast32_t i;
+	uint32_t size;
+	size_t len;
+	int ret;
+
+	ret = list_size(words, &size);
+	if (ret) return ret;
+
+	/* "{" + (20 digits + ",") per word + "}" */
+	*param = malloc(sizeof(char) * (2 + size * 21 + 1));
+	if (*param == NULL) return -ENOMEM;
+
+	len = 0;
+	(*param)[len++] = '{';
+	for (i = 0; i < size; i++) {
+		word_t word;
+
+		ret = list_get(words, i, &word);
+		if (ret) {
+			free(*param);
+			*param = NULL;
+			return ret;
+		}
+
+		len += sprintf(&(*param)[len], i > 0 ? ",%llu" : "%llu", (unsigned long long int)word);
+	}
+	(*param)[len++] = '}';
+	(*param)[len] = 0;
+
+	return OK;
+}
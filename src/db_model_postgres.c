@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,6 +9,7 @@
 #include "err.h"
 #include "types.h"
 #include "db.h"
+#include "dict.h"
 #include "output.h"
 
 #include "db_postgres.h"
@@ -55,6 +57,7 @@ int db_model_set_order(brain_t brain, number_t order) {
 	WARN_IF(order == 0);
 	if (db_connect())
 		return -EDB;
+	conn_written = 1;
 
 	SET_PARAM(param, tmp, 0, brain);
 	SET_PARAM(param, tmp, 1, order);
@@ -64,6 +67,29 @@ int db_model_set_order(brain_t brain, number_t order) {
 		res = PQexecPrepared(conn, "model_add", 2, param, NULL, NULL, 0);
 		if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 		PQclear(res);
+
+		/* the partition is kept (empty) when the model is zapped */
+		if (nodes_partitioned) {
+			char partition[32];
+			const char *table[1] = { partition };
+
+			snprintf(partition, sizeof(partition), "nodes_%llu", (unsigned long long int)brain);
+
+			res = PQexecPrepared(conn, "table_exists", 1, table, NULL, NULL, 1);
+			if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+			if (PQntuples(res) != 1) {
+				char command[128];
+
+				PQclear(res);
+
+				snprintf(command, sizeof(command), "CREATE TABLE %s PARTITION OF nodes FOR VALUES IN (%llu)",
+					partition, (unsigned long long int)brain);
+
+				res = PQexec(conn, command);
+				if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+			}
+			PQclear(res);
+		}
 	} else if (!ret) {
 		res = PQexecPrepared(conn, "model_set", 2, param, NULL, NULL, 0);
 		if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
@@ -80,6 +106,84 @@ fail:
 	return -EDB;
 }
 
+/*
+ * Bitmap of the words (by id) in the model of one brain, loaded on
+ * first use so that db_model_contains doesn't need a query per word.
+ * New words are added as nodes are created. Other learners may add words
+ * at any time, so it's discarded at the start of every transaction (and
+ * when the brain is zapped or merged into or the transaction is rolled back).
+ */
+static struct {
+	brain_t brain;
+	word_t size;
+	uint64_t *bits;
+} model_words = { 0, 0, NULL };
+
+void db_model_words_reset(void) {
+	free(model_words.bits);
+	model_words.brain = 0;
+	model_words.size = 0;
+	model_words.bits = NULL;
+}
+
+static int model_words_add(word_t word) {
+	if (word >= model_words.size) {
+		word_t size = model_words.size > 0 ? model_words.size : 4096;
+		void *mem;
+
+		while (word >= size)
+			size *= 2;
+
+		mem = realloc(model_words.bits, sizeof(uint64_t) * (size / 64));
+		if (mem == NULL) return -ENOMEM;
+
+		model_words.bits = mem;
+		memset(&model_words.bits[model_words.size / 64], 0, sizeof(uint64_t) * ((size - model_words.size) / 64));
+		model_words.size = size;
+	}
+
+	model_words.bits[word / 64] |= 1ULL << (word % 64);
+	return OK;
+}
+
+static int model_words_load(brain_t brain) {
+	PGresult *res;
+	unsigned int num, i;
+	const char *param[1];
+	char tmp[1][32];
+	int ret;
+
+	db_model_words_reset();
+
+	SET_PARAM(param, tmp, 0, brain);
+
+	res = PQexecPrepared(CONN_READ, "model_words", 1, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+
+	num = PQntuples(res);
+	for (i = 0; i < num; i++) {
+		word_t word;
+
+		GET_VALUE(res, i, 0, word);
+
+		ret = model_words_add(word);
+		if (ret) {
+			db_model_words_reset();
+			PQclear(res);
+			return ret;
+		}
+	}
+	PQclear(res);
+
+	model_words.brain = brain;
+	return OK;
+
+fail:
+	log_error("model_words_load", PQresultStatus(res), PQresultErrorMessage(res));
+	PQclear(res);
+	return -EDB;
+}
+
 int db_model_zap(brain_t brain) {
 	PGresult *res;
 	const char *param[1];
@@ -88,13 +192,46 @@ int db_model_zap(brain_t brain) {
 	WARN_IF(brain == 0);
 	if (db_connect())
 		return -EDB;
+	conn_written = 1;
 
 	SET_PARAM(param, tmp, 0, brain);
 
+	if (model_words.brain == brain)
+		db_model_words_reset();
+
+	/*
+	 * Truncate the brain's partition instead of deleting all of its
+	 * nodes. This only locks the partition, so other brains can still
+	 * be used until the transaction ends (dropping it would lock nodes).
+	 */
+	if (nodes_partitioned) {
+		char partition[32];
+		const char *table[1] = { partition };
+		char command[64];
+
+		snprintf(partition, sizeof(partition), "nodes_%llu", (unsigned long long int)brain);
+
+		res = PQexecPrepared(conn, "table_exists", 1, table, NULL, NULL, 1);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+		if (PQntuples(res) == 1) {
+			PQclear(res);
+
+			snprintf(command, sizeof(command), "TRUNCATE %s", partition);
+
+			res = PQexec(conn, command);
+			if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+		}
+		PQclear(res);
+	}
+
 	res = PQexecPrepared(conn, "model_zap", 1, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 	PQclear(res);
 
+	res = PQexecPrepared(conn, "brain_words_zap", 1, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+	PQclear(res);
+
 	return OK;
 
 fail:
@@ -108,6 +245,7 @@ int db_model_node_fill(brain_t brain, db_tree *node) {
 	unsigned int num, pos, i;
 	const char *param[2];
 	char tmp[2][32];
+	void *mem;
 	int found;
 
 	WARN_IF(brain == 0);
@@ -119,30 +257,33 @@ int db_model_node_fill(brain_t brain, db_tree *node) {
 	SET_PARAM(param, tmp, 0, brain);
 	SET_PARAM(param, tmp, 1, node->id);
 
-	res = PQexecPrepared(conn, "model_node_get", 2, param, NULL, NULL, 0);
+	res = PQexecPrepared(CONN_READ, "model_node_get", 2, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
 
 	num = PQntuples(res);
 	if (num == 0) goto not_found;
 
-	if (node->nodes != NULL) {
-		for (i = 0; i < node->children; i++)
-			db_model_node_free((db_tree **)&node->nodes[i++]);
-		free(node->nodes);
-		node->children = 0;
-	}
-
-	node->children = num - 1;
+	node->children = 0;
 
-	if (node->children > 0) {
-		node->nodes = malloc(sizeof(db_tree *) * node->children);
-		if (node->nodes == NULL) {
+	/* Child nodes from a previous fill are kept for re-use,
+	 * only allocate more when this node has a larger fanout.
+	 */
+	if (num - 1 > node->capacity) {
+		mem = realloc(node->nodes, sizeof(db_tree *) * (num - 1));
+		if (mem == NULL) {
 			PQclear(res);
-
-			node->children = 0;
-
 			return -ENOMEM;
 		}
+		node->nodes = mem;
+
+		while (node->capacity < num - 1) {
+			node->nodes[node->capacity] = db_model_node_alloc();
+			if (node->nodes[node->capacity] == NULL) {
+				PQclear(res);
+				return -ENOMEM;
+			}
+			node->capacity++;
+		}
 	}
 
 	found = 0;
@@ -159,16 +300,9 @@ int db_model_node_fill(brain_t brain, db_tree *node) {
 			GET_VALUE(res, i, 2, node->usage);
 			GET_VALUE(res, i, 3, node->count);
 		} else {
-			node->nodes[pos] = db_model_node_alloc();
-			if (node->nodes[pos] == NULL) {
+			if (pos == num - 1) {
 				PQclear(res);
-
-				while (pos > 0)
-					db_model_node_free((db_tree **)&node->nodes[--pos]);
-				free(node->nodes);
-				node->nodes = NULL;
-
-				return -ENOMEM;
+				BUG();
 			}
 
 			child = (db_tree *)node->nodes[pos];
@@ -178,6 +312,7 @@ int db_model_node_fill(brain_t brain, db_tree *node) {
 			GET_VALUE(res, i, 1, child->word);
 			GET_VALUE(res, i, 2, child->usage);
 			GET_VALUE(res, i, 3, child->count);
+			child->children = 0;
 
 			pos++;
 		}
@@ -185,6 +320,7 @@ int db_model_node_fill(brain_t brain, db_tree *node) {
 	PQclear(res);
 
 	BUG_IF(!found);
+	node->children = pos;
 	return OK;
 
 fail:
@@ -214,12 +350,13 @@ int db_model_node_find(brain_t brain, db_tree *tree, word_t word, db_tree **foun
 
 	SET_PARAM(param, tmp, 0, brain);
 	SET_PARAM(param, tmp, 1, tree->id);
-	if (word == 0)
-		param[2] = NULL;
-	else
-		SET_PARAM(param, tmp, 2, word);
 
-	res = PQexecPrepared(conn, "model_node_find", 3, param, NULL, NULL, 0);
+	if (word == 0) {
+		res = PQexecPrepared(CONN_READ, "model_node_find_fin", 2, param, NULL, NULL, 0);
+	} else {
+		SET_PARAM(param, tmp, 2, word);
+		res = PQexecPrepared(CONN_READ, "model_node_find", 3, param, NULL, NULL, 0);
+	}
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
 	if (PQntuples(res) == 0) goto not_found;
 
@@ -329,99 +466,370 @@ fail:
 	return -EDB;
 }
 
+/*
+ * Node ids are assigned here instead of by the database. Each value of
+ * nodes_block_seq reserves a block of NODE_ID_BLOCK ids, so a node's id
+ * is known before it's inserted and new nodes can be inserted together.
+ */
+static node_t node_id_next = 0;
+static node_t node_id_end = 0;
+
+static int node_id_get(node_t *id) {
+	PGresult *res;
+
+	if (node_id_next == node_id_end) {
+		res = PQexecPrepared(conn, "model_reserve_ids", 0, NULL, NULL, NULL, 0);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+		if (PQntuples(res) != 1) goto fail;
+
+		GET_VALUE(res, 0, 0, node_id_next);
+		node_id_next *= NODE_ID_BLOCK;
+		node_id_end = node_id_next + NODE_ID_BLOCK;
+		PQclear(res);
+	}
+
+	*id = node_id_next++;
+	return OK;
+
+fail:
+	log_error("node_id_get", PQresultStatus(res), PQresultErrorMessage(res));
+	PQclear(res);
+	return -EDB;
+}
+
 int db_model_create(brain_t brain, db_tree **node) {
 	PGresult *res;
-	const char *param[1];
-	char tmp[1][32];
+	const char *param[2];
+	char tmp[2][32];
 	db_tree *node_p;
+	int ret;
 
 	WARN_IF(brain == 0);
 	WARN_IF(node == NULL);
 	if (db_connect())
 		return -EDB;
+	conn_written = 1;
 
 	*node = db_model_node_alloc();
 	if (*node == NULL) return -ENOMEM;
 	node_p = *node;
 
-	SET_PARAM(param, tmp, 0, brain);
+	ret = node_id_get(&node_p->id);
+	if (ret) {
+		db_model_node_free(node);
+		return ret;
+	}
+
+	SET_PARAM(param, tmp, 0, node_p->id);
+	SET_PARAM(param, tmp, 1, brain);
 
-	res = PQexecPrepared(conn, "model_create", 1, param, NULL, NULL, 0);
+	res = PQexecPrepared(conn, "model_create", 2, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 	PQclear(res);
 
-	res = PQexecPrepared(conn, "model_create_id", 0, NULL, NULL, NULL, 0);
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
-	if (PQntuples(res) != 1) goto fail;
+	return OK;
 
-	GET_VALUE(res, 0, 0, node_p->id);
+fail:
+	log_error("db_model_create", PQresultStatus(res), PQresultErrorMessage(res));
+	db_model_node_free(node);
+	PQclear(res);
+	return -EDB;
+}
+
+/* count more nodes using a word in the brain's vocabulary */
+static int brain_word_use(brain_t brain, word_t word, number_t nodes) {
+	PGresult *res;
+	const char *param[3];
+	char tmp[3][32];
 
+	SET_PARAM(param, tmp, 0, brain);
+	SET_PARAM(param, tmp, 1, word);
+	SET_PARAM(param, tmp, 2, nodes);
+
+	res = PQexecPrepared(conn, "brain_word_use", 3, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
 	PQclear(res);
 
+	if (model_words.brain == brain && model_words_add(word))
+		db_model_words_reset();
+
 	return OK;
 
 fail:
-	log_error("db_model_create", PQresultStatus(res), PQresultErrorMessage(res));
-	free(*node);
+	log_error("brain_word_use", PQresultStatus(res), PQresultErrorMessage(res));
 	PQclear(res);
 	return -EDB;
 }
 
 int db_model_update(brain_t brain, db_tree *node) {
 	PGresult *res;
-	const char *param[5];
-	char tmp[5][32];
+	const char *param[4];
+	char tmp[4][32];
 
 	WARN_IF(brain == 0);
 	WARN_IF(node == NULL);
-	WARN_IF(node->parent_id == 0 && node->word != 0);
+	WARN_IF(node->id == 0);
+	WARN_IF(node->parent_id != 0);
+	WARN_IF(node->word != 0);
 	if (db_connect())
 		return -EDB;
+	conn_written = 1;
 
-	if (node->id == 0) {
-		SET_PARAM(param, tmp, 0, brain);
-	} else {
-		SET_PARAM(param, tmp, 0, node->id);
-	}
-
+	SET_PARAM(param, tmp, 0, node->id);
 	SET_PARAM(param, tmp, 1, node->usage);
 	SET_PARAM(param, tmp, 2, node->count);
+	/* the brain is needed to use the primary key (brain, id) */
+	SET_PARAM(param, tmp, 3, brain);
 
-	if (node->parent_id == 0) {
-		res = PQexecPrepared(conn, "model_rootupdate", 3, param, NULL, NULL, 0);
-		if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-		PQclear(res);
-	} else if (node->id == 0) {
-		if (node->word == 0) {
-			param[3] = NULL;
-		} else {
-			SET_PARAM(param, tmp, 3, node->word);
-		}
-		SET_PARAM(param, tmp, 4, node->parent_id);
+	res = PQexecPrepared(conn, "model_rootupdate", 4, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+	PQclear(res);
 
-		res = PQexecPrepared(conn, "model_fastcreate", 5, param, NULL, NULL, 0);
-		if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-		PQclear(res);
+	return OK;
 
-		res = PQexecPrepared(conn, "model_create_id", 0, NULL, NULL, NULL, 0);
-		if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
-		if (PQntuples(res) != 1) goto fail;
+fail:
+	log_error("db_model_update", PQresultStatus(res), PQresultErrorMessage(res));
+	PQclear(res);
+	return -EDB;
+}
 
-		GET_VALUE(res, 0, 0, node->id);
+/* append a value to an array parameter ("{1,2,3}") */
+static size_t array_append(char *array, size_t len, uint64_t value) {
+	return len + sprintf(&array[len], "%c%llu", len == 0 ? '{' : ',', (unsigned long long int)value);
+}
 
-		PQclear(res);
-	} else {
-		res = PQexecPrepared(conn, "model_update", 3, param, NULL, NULL, 0);
-		if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-		PQclear(res);
+/*
+ * Uses of contexts are kept here until the transaction is committed and
+ * then added to their usage in one statement. Every line starts from the
+ * root nodes, so updating them when each word is learnt would lock them
+ * for the rest of the transaction and stop other learners on the brain.
+ * Until then, reads from the database don't include these uses.
+ */
+#define CONTEXT_USES_MAX 65536 /* added early if a transaction uses more contexts */
+
+static struct {
+	brain_t brain;
+	size_t size;
+	size_t capacity;
+	node_t *ids;
+} context_uses = { 0, 0, 0, NULL };
+
+void db_model_use_reset(void) {
+	free(context_uses.ids);
+	context_uses.brain = 0;
+	context_uses.size = 0;
+	context_uses.capacity = 0;
+	context_uses.ids = NULL;
+}
+
+static int compare_node_id(const void *a, const void *b) {
+	node_t x = *(const node_t *)a;
+	node_t y = *(const node_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int db_model_use_flush(void) {
+	PGresult *res = NULL;
+	const char *param[3];
+	char tmp[1][32];
+	char *ids_param, *uses_param;
+	size_t ids_len = 0, uses_len = 0;
+	size_t i, j;
+	int ret = OK;
+
+	if (context_uses.size == 0)
+		return OK;
+
+	ids_param = malloc(context_uses.size * 21 + 2);
+	uses_param = malloc(context_uses.size * 21 + 2);
+	if (ids_param == NULL || uses_param == NULL) {
+		ret = -ENOMEM;
+		goto free;
 	}
 
-	return OK;
+	/* sorted so that the nodes are locked in order of id */
+	qsort(context_uses.ids, context_uses.size, sizeof(node_t), compare_node_id);
+
+	for (i = 0; i < context_uses.size; i = j) {
+		for (j = i + 1; j < context_uses.size; j++)
+			if (context_uses.ids[j] != context_uses.ids[i])
+				break;
+
+		ids_len = array_append(ids_param, ids_len, context_uses.ids[i]);
+		uses_len = array_append(uses_param, uses_len, j - i);
+	}
+	strcpy(&ids_param[ids_len], "}");
+	strcpy(&uses_param[uses_len], "}");
+
+	SET_PARAM(param, tmp, 0, context_uses.brain);
+	param[1] = ids_param;
+	param[2] = uses_param;
+
+	res = PQexecPrepared(conn, "model_use_context", 3, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+
+	context_uses.size = 0;
+
+free:
+	PQclear(res);
+	free(uses_param);
+	free(ids_param);
+	return ret;
 
 fail:
-	log_error("db_model_update", PQresultStatus(res), PQresultErrorMessage(res));
+	log_error("db_model_use_flush", PQresultStatus(res), PQresultErrorMessage(res));
+	ret = -EDB;
+	goto free;
+}
+
+static int context_use(brain_t brain, node_t id) {
+	int ret;
+
+	if (context_uses.brain != brain || context_uses.size == CONTEXT_USES_MAX) {
+		ret = db_model_use_flush();
+		if (ret) return ret;
+
+		context_uses.brain = brain;
+	}
+
+	if (context_uses.size == context_uses.capacity) {
+		size_t capacity = context_uses.capacity > 0 ? context_uses.capacity * 2 : 256;
+		void *mem;
+
+		mem = realloc(context_uses.ids, sizeof(node_t) * capacity);
+		if (mem == NULL) return -ENOMEM;
+
+		context_uses.ids = mem;
+		context_uses.capacity = capacity;
+	}
+
+	context_uses.ids[context_uses.size++] = id;
+	return OK;
+}
+
+int db_model_use(brain_t brain, db_tree **contexts, number_t size, word_t word) {
+	PGresult *res = NULL;
+	const char *param[4];
+	char tmp[4][32];
+	node_t *parents, *ids;
+	char *parents_param, *ids_param;
+	size_t parents_len = 0, ids_len = 0;
+	number_t i, created = 0;
+	unsigned int num, j;
+	int ret = OK;
+
+	WARN_IF(brain == 0);
+	WARN_IF(contexts == NULL);
+	if (db_connect())
+		return -EDB;
+	conn_written = 1;
+
+	/* parents[i] is the context that the node in contexts[i] follows */
+	parents = calloc(size, sizeof(node_t));
+	ids = calloc(size, sizeof(node_t));
+	parents_param = malloc(size * 21 + 2);
+	ids_param = malloc(size * 21 + 2);
+	if (parents == NULL || ids == NULL || parents_param == NULL || ids_param == NULL) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	for (i = 1; i < size; i++) {
+		if (contexts[i - 1] == NULL)
+			continue;
+
+		WARN_IF(contexts[i - 1]->id == 0);
+		parents[i] = contexts[i - 1]->id;
+		parents_len = array_append(parents_param, parents_len, parents[i]);
+
+		ret = context_use(brain, parents[i]);
+		if (ret) goto free;
+		contexts[i - 1]->usage++;
+
+		ret = node_id_get(&ids[i]);
+		if (ret) goto free;
+		ids_len = array_append(ids_param, ids_len, ids[i]);
+	}
+
+	if (parents_len == 0)
+		goto free;
+
+	strcpy(&parents_param[parents_len], "}");
+	strcpy(&ids_param[ids_len], "}");
+
+	SET_PARAM(param, tmp, 0, brain);
+	param[1] = parents_param;
+	param[2] = ids_param;
+
+	/*
+	 * The counts are incremented in the database (instead of writing
+	 * back the values read earlier) so that concurrent learners don't
+	 * lose updates, and new nodes are upserted in case another learner
+	 * has just created them. The usage of the contexts is added when
+	 * the transaction is committed.
+	 */
+	if (word == 0) {
+		res = PQexecPrepared(conn, "model_use_fin", 3, param, NULL, NULL, 0);
+	} else {
+		SET_PARAM(param, tmp, 3, word);
+		res = PQexecPrepared(conn, "model_use", 4, param, NULL, NULL, 0);
+	}
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+
+	num = PQntuples(res);
+	for (j = 0; j < num; j++) {
+		node_t parent;
+
+		GET_VALUE(res, j, 1, parent);
+		for (i = 1; i < size; i++)
+			if (parents[i] == parent)
+				break;
+		if (i == size) {
+			log_error("db_model_use", parent, "Node returned for unknown context");
+			ret = -EDB;
+			goto free;
+		}
+
+		if (contexts[i] != NULL) {
+			ret = db_model_node_clear(contexts[i]);
+			if (ret) goto free;
+		} else {
+			contexts[i] = db_model_node_alloc();
+			if (contexts[i] == NULL) {
+				ret = -ENOMEM;
+				goto free;
+			}
+		}
+
+		contexts[i]->parent_id = parent;
+		contexts[i]->word = word;
+		GET_VALUE(res, j, 0, contexts[i]->id);
+		GET_VALUE(res, j, 2, contexts[i]->usage);
+		GET_VALUE(res, j, 3, contexts[i]->count);
+
+		/* the node was created if it has the id that was reserved for it */
+		if (contexts[i]->id == ids[i])
+			created++;
+	}
 	PQclear(res);
-	return -EDB;
+	res = NULL;
+
+	if (word != 0 && created > 0)
+		ret = brain_word_use(brain, word, created);
+
+free:
+	PQclear(res);
+	free(ids_param);
+	free(parents_param);
+	free(ids);
+	free(parents);
+	return ret;
+
+fail:
+	log_error("db_model_use", PQresultStatus(res), PQresultErrorMessage(res));
+	ret = -EDB;
+	goto free;
 }
 
 int db_model_link(db_tree *parent, db_tree *child) {
@@ -436,32 +844,21 @@ int db_model_link(db_tree *parent, db_tree *child) {
 }
 
 int db_model_contains(brain_t brain, word_t word) {
-	PGresult *res;
-	const char *param[2];
-	char tmp[2][32];
+	int ret;
 
 	WARN_IF(brain == 0);
 	WARN_IF(word == 0);
 	if (db_connect())
 		return -EDB;
 
-	SET_PARAM(param, tmp, 0, brain);
-	SET_PARAM(param, tmp, 1, word);
-
-	res = PQexecPrepared(conn, "model_word_exists", 2, param, NULL, NULL, 0);
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
-	if (PQntuples(res) == 0) goto not_found;
-
-	PQclear(res);
-	return OK;
+	if (model_words.brain != brain) {
+		ret = model_words_load(brain);
+		if (ret) return ret;
+	}
 
-fail:
-	log_error("db_model_contains", PQresultStatus(res), PQresultErrorMessage(res));
-	PQclear(res);
-	return -EDB;
+	if (word < model_words.size && (model_words.bits[word / 64] & (1ULL << (word % 64))) != 0)
+		return OK;
 
-not_found:
-	PQclear(res);
 	return -ENOTFOUND;
 }
 
@@ -479,7 +876,7 @@ int db_model_rand_word(brain_t brain, const db_tree *node, word_t *word) {
 	SET_PARAM(param, tmp, 0, brain);
 	SET_PARAM(param, tmp, 1, node->id);
 
-	res = PQexecPrepared(conn, "model_word_random", 2, param, NULL, NULL, 0);
+	res = PQexecPrepared(CONN_READ, "model_word_random", 2, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
 	if (PQntuples(res) == 0) goto not_found;
 
@@ -514,7 +911,7 @@ int db_model_rand_node(brain_t brain, const db_tree *parent, db_tree **node) {
 	SET_PARAM(param, tmp, 0, brain);
 	SET_PARAM(param, tmp, 1, parent->id);
 
-	res = PQexecPrepared(conn, "model_node_random", 2, param, NULL, NULL, 0);
+	res = PQexecPrepared(CONN_READ, "model_node_random", 2, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
 	if (PQntuples(res) == 0) goto not_found;
 
@@ -563,12 +960,12 @@ int db_model_next_node(brain_t brain, const db_tree *current, db_tree **next) {
 	SET_PARAM(param, tmp, 1, current->parent_id);
 	SET_PARAM(param, tmp, 2, current->id);
 
-	res = PQexecPrepared(conn, "model_node_next", 3, param, NULL, NULL, 0);
+	res = PQexecPrepared(CONN_READ, "model_node_next", 3, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
 	if (PQntuples(res) == 0) {
 		PQclear(res);
 
-		res = PQexecPrepared(conn, "model_node_first", 2, param, NULL, NULL, 0);
+		res = PQexecPrepared(CONN_READ, "model_node_first", 2, param, NULL, NULL, 0);
 		if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
 		if (PQntuples(res) == 0) goto not_found;
 	}
@@ -656,3 +1053,487 @@ fail:
 	PQclear(res);
 	return -EDB;
 }
+
+int db_model_keywords(brain_t brain, const list_t *words, int (*callback)(void *data, word_t word, uint8_t flags), void *data) {
+	PGresult *res;
+	unsigned int num, i;
+	const char *param[2];
+	char tmp[1][32];
+	char *array;
+	uint32_t size;
+	int ret;
+
+	WARN_IF(brain == 0);
+	WARN_IF(words == NULL);
+	WARN_IF(callback == NULL);
+	if (db_connect())
+		return -EDB;
+
+	ret = list_size(words, &size);
+	if (ret) return ret;
+
+	if (size == 0)
+		return OK;
+
+	ret = db_array_param(words, &array);
+	if (ret) return ret;
+
+	SET_PARAM(param, tmp, 0, brain);
+	param[1] = array;
+
+	res = PQexecPrepared(conn, "model_keywords", 2, param, NULL, NULL, 0);
+	free(array);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+
+	num = PQntuples(res);
+	if (num != size) goto not_found;
+
+	for (i = 0; i < num; i++) {
+		word_t word;
+		uint8_t flags = 0;
+
+		GET_VALUE(res, i, 0, word);
+		if (PQgetvalue(res, i, 1)[0] == 't') flags |= DB_KEYWORD_F_BAN;
+		if (PQgetvalue(res, i, 2)[0] == 't') flags |= DB_KEYWORD_F_AUX;
+		if (PQgetvalue(res, i, 3)[0] == 't') flags |= DB_KEYWORD_F_MODEL;
+		if (PQgetvalue(res, i, 4)[0] == 't') flags |= DB_KEYWORD_F_ALNUM;
+
+		ret = callback(data, word, flags);
+		if (ret) {
+			PQclear(res);
+			return ret;
+		}
+	}
+
+	PQclear(res);
+	return OK;
+
+fail:
+	log_error("db_model_keywords", PQresultStatus(res), PQresultErrorMessage(res));
+	PQclear(res);
+	return -EDB;
+
+not_found:
+	PQclear(res);
+	return -ENOTFOUND;
+}
+
+static int merge_exec(const char *command, int params, const char * const *param) {
+	PGresult *res;
+
+	res = PQexecParams(conn, command, params, NULL, param, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+
+	PQclear(res);
+	return OK;
+
+fail:
+	log_error("db_model_merge", PQresultStatus(res), PQresultErrorMessage(res));
+	PQclear(res);
+	return -EDB;
+}
+
+static int merge_copy(const db_merge_node *nodes, number_t size, node_t forward, node_t backward, number_t forward_idx, number_t backward_idx) {
+	PGresult *res;
+	char buf[8192];
+	size_t len = 0;
+	number_t i;
+
+	res = PQexec(conn, "COPY nodes_merge (id, parent, depth, word, usage, count, node) FROM STDIN");
+	if (PQresultStatus(res) != PGRES_COPY_IN) goto fail;
+	PQclear(res);
+
+	for (i = 0; i < size; i++) {
+		const db_merge_node *node = &nodes[i];
+
+		if (len > sizeof(buf) - 256) {
+			if (PQputCopyData(conn, buf, len) != 1) goto fail_copy;
+			len = 0;
+		}
+
+		if (i == forward_idx || i == backward_idx) {
+			len += sprintf(&buf[len], "%llu\t\\N\t0\t0\t%llu\t%llu\t%llu\n",
+				(unsigned long long int)i, (unsigned long long int)node->usage, (unsigned long long int)node->count,
+				(unsigned long long int)(i == forward_idx ? forward : backward));
+		} else {
+			len += sprintf(&buf[len], "%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t\\N\n",
+				(unsigned long long int)i, (unsigned long long int)node->parent, (unsigned long long int)node->depth,
+				(unsigned long long int)node->word, (unsigned long long int)node->usage, (unsigned long long int)node->count);
+		}
+	}
+
+	if (len > 0 && PQputCopyData(conn, buf, len) != 1) goto fail_copy;
+	if (PQputCopyEnd(conn, NULL) != 1) goto fail_copy;
+
+	res = PQgetResult(conn);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+	PQclear(res);
+
+	while ((res = PQgetResult(conn)) != NULL)
+		PQclear(res);
+
+	return OK;
+
+fail:
+	log_error("db_model_merge", PQresultStatus(res), PQresultErrorMessage(res));
+	PQclear(res);
+	return -EDB;
+
+fail_copy:
+	log_error("db_model_merge", PQstatus(conn), PQerrorMessage(conn));
+	return -EDB;
+}
+
+int db_model_merge(brain_t brain, const db_merge_node *nodes, number_t size, number_t forward_idx, number_t backward_idx) {
+	const char *param[3];
+	char tmp[3][32];
+	db_tree *forward = NULL;
+	db_tree *backward = NULL;
+	number_t depth, max_depth = 0;
+	number_t i;
+	int ret;
+
+	WARN_IF(brain == 0);
+	WARN_IF(nodes == NULL);
+	WARN_IF(forward_idx >= size);
+	WARN_IF(backward_idx >= size);
+	if (db_connect())
+		return -EDB;
+	conn_written = 1;
+
+	for (i = 0; i < size; i++)
+		if (nodes[i].depth > max_depth)
+			max_depth = nodes[i].depth;
+
+	ret = db_model_get_root(brain, &forward, &backward);
+	if (ret) return ret;
+
+	ret = merge_exec("CREATE TEMPORARY TABLE nodes_merge (id BIGINT NOT NULL, parent BIGINT, depth BIGINT NOT NULL,"\
+		" word BIGINT NOT NULL, usage BIGINT NOT NULL, count BIGINT NOT NULL, node BIGINT, created BOOLEAN NOT NULL DEFAULT FALSE)"\
+		" ON COMMIT DROP", 0, NULL);
+	if (ret) goto fail;
+
+	ret = merge_copy(nodes, size, forward->id, backward->id, forward_idx, backward_idx);
+	if (ret) goto fail;
+
+	ret = merge_exec("CREATE INDEX nodes_merge_id ON nodes_merge (id)", 0, NULL);
+	if (ret) goto fail;
+
+	ret = merge_exec("CREATE INDEX nodes_merge_depth ON nodes_merge (depth)", 0, NULL);
+	if (ret) goto fail;
+
+	ret = merge_exec("ANALYZE nodes_merge", 0, NULL);
+	if (ret) goto fail;
+
+	SET_PARAM(param, tmp, 2, (unsigned int)NODE_ID_BLOCK);
+
+	/*
+	 * Process one level of the trees at a time so that the parent of
+	 * every node has already been matched to (or created in) the model.
+	 * Every statement on nodes matches the brain so that only its own
+	 * partition is used.
+	 */
+	for (depth = 0; depth <= max_depth; depth++) {
+		SET_PARAM(param, tmp, 0, depth);
+		SET_PARAM(param, tmp, 1, brain);
+
+		if (depth > 0) {
+			/* find existing nodes */
+			ret = merge_exec("UPDATE nodes_merge AS m SET node = nodes.id FROM nodes_merge AS p, nodes"\
+				" WHERE m.depth = $1 AND p.id = m.parent AND nodes.brain = $2 AND nodes.parent = p.node AND COALESCE(nodes.word, 0) = m.word", 2, param);
+			if (ret) goto fail;
+
+			/* create new nodes (with ids from as many blocks as they need) */
+			ret = merge_exec("WITH new AS (SELECT id, ROW_NUMBER() OVER (ORDER BY id) - 1 AS n FROM nodes_merge WHERE depth = $1 AND node IS NULL),"\
+				" blocks AS (SELECT b - 1 AS n, nextval('nodes_block_seq') AS block"\
+					" FROM generate_series(1, (SELECT (COUNT(*) + $3 - 1) / $3 FROM new)) AS b)"\
+				" UPDATE nodes_merge AS m SET node = blocks.block * $3 + new.n % $3, created = TRUE FROM new, blocks"\
+				" WHERE m.id = new.id AND blocks.n = new.n / $3", 3, param);
+			if (ret) goto fail;
+
+			ret = merge_exec("INSERT INTO nodes (id, brain, parent, word, usage, count)"\
+				" SELECT m.node, $2, p.node, NULLIF(m.word, 0), m.usage, m.count FROM nodes_merge AS m, nodes_merge AS p"\
+				" WHERE m.depth = $1 AND m.created AND p.id = m.parent", 2, param);
+			if (ret) goto fail;
+		}
+
+		/* add to existing nodes */
+		ret = merge_exec("UPDATE nodes SET usage = nodes.usage + m.usage, count = nodes.count + m.count FROM nodes_merge AS m"\
+			" WHERE m.depth = $1 AND NOT m.created AND nodes.brain = $2 AND nodes.id = m.node", 2, param);
+		if (ret) goto fail;
+	}
+
+	/* update the vocabulary with the words of the new nodes */
+	SET_PARAM(param, tmp, 0, brain);
+
+	ret = merge_exec("UPDATE brain_words SET refcount = brain_words.refcount + m.nodes"\
+		" FROM (SELECT word, COUNT(*) AS nodes FROM nodes_merge WHERE created AND word <> 0 GROUP BY word) AS m"\
+		" WHERE brain_words.brain = $1 AND brain_words.word = m.word", 1, param);
+	if (ret) goto fail;
+
+	ret = merge_exec("INSERT INTO brain_words (brain, word, refcount)"\
+		" SELECT $1, word, COUNT(*) FROM nodes_merge"\
+		" WHERE created AND word <> 0 AND NOT EXISTS (SELECT 1 FROM brain_words WHERE brain = $1 AND brain_words.word = nodes_merge.word)"\
+		" GROUP BY word", 1, param);
+	if (ret) goto fail;
+
+	if (model_words.brain == brain)
+		db_model_words_reset();
+
+	ret = merge_exec("DROP TABLE nodes_merge", 0, NULL);
+	if (ret) goto fail;
+
+fail:
+	db_model_node_free(&forward);
+	db_model_node_free(&backward);
+	return ret;
+}
+
+#define LOAD_BUFFER (1 << 20)
+
+/*
+ * New nodes for a bulk load are copied into a staging table without
+ * any indexes or constraints (a regular table if it will become the
+ * brain's partition, otherwise temporary). The constraints are checked
+ * and the indexes are built once when the nodes are added to the model.
+ * The staging table is logged from the start because making an unlogged
+ * table logged writes all of it to the WAL again.
+ */
+/*
+ * Indexes of a partition of nodes (name suffix and definition, given the
+ * staging table's name twice), built on the staging table so that they
+ * can be used when it's attached.
+ */
+static const char *const load_indexes[][2] = {
+	{ "pkey", "ALTER TABLE %s ADD CONSTRAINT %s_pkey PRIMARY KEY (brain, id)" },
+	{ "child", "CREATE UNIQUE INDEX %s_child ON %s (brain, parent, word)" },
+	{ "fin", "CREATE UNIQUE INDEX %s_fin ON %s (brain, parent) WHERE word IS NULL" },
+	{ "words", "CREATE INDEX %s_words ON %s (word)" },
+	{ "find", "CREATE INDEX %s_find ON %s (parent, word, brain) INCLUDE (id, usage, count)" },
+	{ "order", "CREATE INDEX %s_order ON %s (parent, brain, id) INCLUDE (word, usage, count)" },
+};
+
+static struct {
+	brain_t brain;
+	char table[64];
+
+	size_t len;
+	char *buf;
+} model_load = { 0 };
+
+static int load_exec(const char *command) {
+	PGresult *res;
+
+	res = PQexec(conn, command);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+
+	PQclear(res);
+	return OK;
+
+fail:
+	log_error("db_model_load", PQresultStatus(res), PQresultErrorMessage(res));
+	PQclear(res);
+	return -EDB;
+}
+
+static int load_flush(void) {
+	PGresult *res;
+	char command[128];
+
+	if (model_load.len == 0)
+		return OK;
+
+	snprintf(command, sizeof(command), "COPY %s (id, brain, parent, word, usage, count) FROM STDIN", model_load.table);
+
+	res = PQexec(conn, command);
+	if (PQresultStatus(res) != PGRES_COPY_IN) goto fail;
+	PQclear(res);
+
+	if (PQputCopyData(conn, model_load.buf, model_load.len) != 1) goto fail_copy;
+	if (PQputCopyEnd(conn, NULL) != 1) goto fail_copy;
+
+	res = PQgetResult(conn);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
+	PQclear(res);
+
+	while ((res = PQgetResult(conn)) != NULL)
+		PQclear(res);
+
+	model_load.len = 0;
+	return OK;
+
+fail:
+	log_error("db_model_load", PQresultStatus(res), PQresultErrorMessage(res));
+	PQclear(res);
+	return -EDB;
+
+fail_copy:
+	log_error("db_model_load", PQstatus(conn), PQerrorMessage(conn));
+	return -EDB;
+}
+
+int db_model_load_begin(brain_t brain) {
+	char command[128];
+	int ret;
+
+	WARN_IF(brain == 0);
+	WARN_IF(model_load.buf != NULL);
+	if (db_connect())
+		return -EDB;
+	conn_written = 1;
+
+	model_load.buf = malloc(LOAD_BUFFER);
+	if (model_load.buf == NULL) return -ENOMEM;
+
+	model_load.brain = brain;
+	model_load.len = 0;
+	snprintf(model_load.table, sizeof(model_load.table), "nodes_load_%llu", (unsigned long long int)brain);
+
+	if (nodes_partitioned)
+		snprintf(command, sizeof(command), "CREATE TABLE %s (LIKE nodes)", model_load.table);
+	else
+		snprintf(command, sizeof(command), "CREATE TEMPORARY TABLE %s (LIKE nodes) ON COMMIT DROP", model_load.table);
+
+	ret = load_exec(command);
+	if (ret) db_model_load_abort();
+	return ret;
+}
+
+int db_model_load_node(brain_t brain, db_tree *node) {
+	int ret;
+
+	WARN_IF(brain == 0);
+	WARN_IF(brain != model_load.brain);
+	WARN_IF(node == NULL);
+	WARN_IF(node->id != 0);
+	WARN_IF(node->parent_id == 0);
+
+	if (model_load.len > LOAD_BUFFER - 256) {
+		ret = load_flush();
+		if (ret) return ret;
+	}
+
+	ret = node_id_get(&node->id);
+	if (ret) return ret;
+
+	if (node->word == 0) {
+		model_load.len += sprintf(&model_load.buf[model_load.len], "%llu\t%llu\t%llu\t\\N\t%llu\t%llu\n",
+			(unsigned long long int)node->id, (unsigned long long int)brain, (unsigned long long int)node->parent_id,
+			(unsigned long long int)node->usage, (unsigned long long int)node->count);
+	} else {
+		model_load.len += sprintf(&model_load.buf[model_load.len], "%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+			(unsigned long long int)node->id, (unsigned long long int)brain, (unsigned long long int)node->parent_id,
+			(unsigned long long int)node->word, (unsigned long long int)node->usage, (unsigned long long int)node->count);
+	}
+
+	return OK;
+}
+
+int db_model_load_end(brain_t brain) {
+	char command[512];
+	unsigned long long int id = brain;
+	const char *table = model_load.table;
+	size_t i;
+	int ret;
+
+	WARN_IF(brain == 0);
+	WARN_IF(brain != model_load.brain);
+	WARN_IF(model_load.buf == NULL);
+
+	ret = load_flush();
+	if (ret) goto fail;
+
+	/* the model was zapped before loading, so it has no words yet */
+	snprintf(command, sizeof(command), "INSERT INTO brain_words (brain, word, refcount)"\
+		" SELECT brain, word, COUNT(*) FROM %s WHERE word IS NOT NULL GROUP BY brain, word", table);
+	ret = load_exec(command);
+	if (ret) goto fail;
+
+	if (model_words.brain == brain)
+		db_model_words_reset();
+
+	if (nodes_partitioned) {
+		/*
+		 * Replace the brain's partition (which only has the root
+		 * nodes) with the staging table. The constraints, indexes and
+		 * foreign keys are added to the staging table first, because
+		 * the partition can only be dropped and attached while nodes
+		 * is locked for every brain. Attaching it then uses them
+		 * instead of checking and building them again.
+		 */
+		snprintf(command, sizeof(command), "INSERT INTO %s (id, brain, parent, word, usage, count)"\
+			" SELECT id, brain, parent, word, usage, count FROM nodes_%llu", table, id);
+		ret = load_exec(command);
+		if (ret) goto fail;
+
+		snprintf(command, sizeof(command), "ALTER TABLE %s"\
+			" ADD CONSTRAINT valid_brain CHECK (brain = %llu),"\
+			" ADD CONSTRAINT valid_id CHECK (id > 0),"\
+			" ADD CONSTRAINT valid_usage CHECK (usage >= 0),"\
+			" ADD CONSTRAINT valid_count CHECK (count >= 0),"\
+			" ADD CONSTRAINT valid_root CHECK (parent IS NOT NULL OR word IS NULL),"\
+			" ADD CONSTRAINT valid_fin CHECK (parent IS NULL OR word IS NOT NULL OR usage = 0)", table, id);
+		ret = load_exec(command);
+		if (ret) goto fail;
+
+		for (i = 0; i < sizeof(load_indexes) / sizeof(load_indexes[0]); i++) {
+			snprintf(command, sizeof(command), load_indexes[i][1], table, table);
+			ret = load_exec(command);
+			if (ret) goto fail;
+		}
+
+		/* validated separately so that words is only locked briefly */
+		snprintf(command, sizeof(command), "ALTER TABLE %s ADD CONSTRAINT nodes_word_fkey"\
+			" FOREIGN KEY (word) REFERENCES words (id) ON UPDATE CASCADE ON DELETE CASCADE NOT VALID", table);
+		ret = load_exec(command);
+		if (ret) goto fail;
+
+		snprintf(command, sizeof(command), "ALTER TABLE %s VALIDATE CONSTRAINT nodes_word_fkey", table);
+		ret = load_exec(command);
+		if (ret) goto fail;
+
+		snprintf(command, sizeof(command), "DROP TABLE nodes_%llu", id);
+		ret = load_exec(command);
+		if (ret) goto fail;
+
+		snprintf(command, sizeof(command), "ALTER TABLE %s RENAME TO nodes_%llu", table, id);
+		ret = load_exec(command);
+		if (ret) goto fail;
+
+		snprintf(command, sizeof(command), "ALTER TABLE nodes ATTACH PARTITION nodes_%llu FOR VALUES IN (%llu)", id, id);
+		ret = load_exec(command);
+		if (ret) goto fail;
+
+		/* the next staging table will use the same index names */
+		for (i = 0; i < sizeof(load_indexes) / sizeof(load_indexes[0]); i++) {
+			snprintf(command, sizeof(command), "ALTER INDEX %s_%s RENAME TO nodes_%llu_%s",
+				table, load_indexes[i][0], id, load_indexes[i][0]);
+			ret = load_exec(command);
+			if (ret) goto fail;
+		}
+
+		snprintf(command, sizeof(command), "ANALYZE nodes_%llu", id);
+		ret = load_exec(command);
+		if (ret) goto fail;
+	} else {
+		snprintf(command, sizeof(command), "INSERT INTO nodes (id, brain, parent, word, usage, count)"\
+			" SELECT id, brain, parent, word, usage, count FROM %s", table);
+		ret = load_exec(command);
+		if (ret) goto fail;
+
+		snprintf(command, sizeof(command), "DROP TABLE %s", table);
+		ret = load_exec(command);
+		if (ret) goto fail;
+	}
+
+fail:
+	db_model_load_abort();
+	return ret;
+}
+
+void db_model_load_abort(void) {
+	free(model_load.buf);
+	model_load.buf = NULL;
+	model_load.brain = 0;
+	model_load.len = 0;
+}
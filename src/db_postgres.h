@@ -1,6 +1,19 @@
 #include <libpq-fe.h>
 
 PGconn *conn;
+extern PGconn *conn_read;     /* connection for reads from the model (may be conn) */
+extern int conn_written;      /* written to conn since the last commit/rollback */
+
+/* connection to use for reads from the model */
+#define CONN_READ (conn_written ? conn : conn_read)
+extern int nodes_partitioned; /* nodes table is partitioned by brain */
+
+#define NODE_ID_BLOCK 10000   /* ids in each block reserved from nodes_block_seq */
+
+int db_array_param(const list_t *words, char **param); /* format words as an array parameter */
+void db_model_words_reset(void);                       /* discard the cached model words */
+int db_model_use_flush(void);                          /* add the pending uses of contexts to their usage */
+void db_model_use_reset(void);                         /* discard the pending uses of contexts */
 
 #define SET_PARAM(param, buf, pos, value) do { \
 	param[pos] = buf[pos]; \
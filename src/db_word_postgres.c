@@ -8,27 +8,27 @@
 #include "err.h"
 #include "types.h"
 #include "db.h"
+#include "dict.h"
 #include "output.h"
 
 #include "db_postgres.h"
 
-int db_word_add(const char *word, word_t *ref) {
+int db_word_add(const char *word, word_t *ref, uint8_t *flags) {
 	PGresult *res;
 	const char *param[1];
 
 	if (word == NULL || ref == NULL) return -EINVAL;
 	if (db_connect()) return -EDB;
+	conn_written = 1;
 
 	param[0] = word;
-	res = PQexecPrepared(conn, "word_add", 1, param, NULL, NULL, 1);
-	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto fail;
-	PQclear(res);
-
-	res = PQexecPrepared(conn, "word_add_id", 0, NULL, NULL, NULL, 0);
+	res = PQexecPrepared(conn, "word_add", 1, param, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
 	if (PQntuples(res) != 1) goto fail;
 
 	GET_VALUE(res, 0, 0, *ref);
+	if (flags != NULL)
+		*flags = strtoul(PQgetvalue(res, 0, 1), NULL, 10);
 
 	PQclear(res);
 
@@ -40,7 +40,7 @@ fail:
 	return -EDB;
 }
 
-int db_word_get(const char *word, word_t *ref) {
+int db_word_get(const char *word, word_t *ref, uint8_t *flags) {
 	PGresult *res;
 	const char *param[1];
 
@@ -53,6 +53,8 @@ int db_word_get(const char *word, word_t *ref) {
 	if (PQntuples(res) == 0) goto end;
 
 	GET_VALUE(res, 0, 0, *ref);
+	if (flags != NULL)
+		*flags = strtoul(PQgetvalue(res, 0, 1), NULL, 10);
 
 	PQclear(res);
 
@@ -105,3 +107,64 @@ end:
 	PQclear(res);
 	return -ENOTFOUND;
 }
+
+int db_word_strs(const list_t *words, int (*allocate)(void *data, number_t length), int (*callback)(void *data, const char *word, size_t len), void *data) {
+	PGresult *res;
+	const char *param[1];
+	char *array;
+	unsigned int num, i;
+	uint32_t size;
+	number_t length;
+	int ret;
+
+	if (words == NULL || allocate == NULL || callback == NULL) return -EINVAL;
+	if (db_connect()) return -EDB;
+
+	ret = list_size(words, &size);
+	if (ret) return ret;
+
+	if (size == 0)
+		return allocate(data, 0);
+
+	ret = db_array_param(words, &array);
+	if (ret) return ret;
+
+	param[0] = array;
+	res = PQexecPrepared(conn, "word_strs", 1, param, NULL, NULL, 0);
+	free(array);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) goto fail;
+
+	num = PQntuples(res);
+	if (num != size) goto end;
+
+	length = 0;
+	for (i = 0; i < num; i++)
+		length += PQgetlength(res, i, 0);
+
+	ret = allocate(data, length);
+	if (ret) {
+		PQclear(res);
+		return ret;
+	}
+
+	for (i = 0; i < num; i++) {
+		ret = callback(data, PQgetvalue(res, i, 0), PQgetlength(res, i, 0));
+		if (ret) {
+			PQclear(res);
+			return ret;
+		}
+	}
+
+	PQclear(res);
+
+	return OK;
+
+fail:
+	log_error("db_word_strs", PQresultStatus(res), PQresultErrorMessage(res));
+	PQclear(res);
+	return -EDB;
+
+end:
+	PQclear(res);
+	return -ENOTFOUND;
+}
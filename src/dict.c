@@ -5,6 +5,7 @@
 
 #include "err.h"
 #include "types.h"
+#include "arena.h"
 #include "db.h"
 #include "dict.h"
 
@@ -35,7 +36,7 @@ int load_list(const char *name, enum list type, const char *filename) {
 		if ((string != NULL) && (strlen(string) > 0)) {
 			word_t word;
 
-			ret = db_word_use(string, &word);
+			ret = db_word_use(string, &word, NULL);
 			if (ret) goto fail;
 
 			ret = db_list_contains(brain, type, word);
@@ -148,10 +149,10 @@ int load_map(const char *name, enum map type, const char *filename) {
 		if ((from != NULL) && (strlen(from) > 0) && (to != NULL) && (strlen(to) > 0)) {
 			word_t key, value;
 
-			ret = db_word_use(from, &key);
+			ret = db_word_use(from, &key, NULL);
 			if (ret) goto fail;
 
-			ret = db_word_use(to, &value);
+			ret = db_word_use(to, &value, NULL);
 			if (ret) goto fail;
 
 			ret = db_map_get(brain, type, key, &value);
@@ -227,14 +228,59 @@ fail:
 	return ret;
 }
 
-dict_t *dict_alloc(void) {
+static void *words_alloc(arena_t *arena, size_t size) {
+	if (arena != NULL)
+		return arena_get(arena, size);
+	return malloc(size);
+}
+
+/* memory from an arena is released with the arena */
+static void words_free(arena_t *arena, void *mem) {
+	if (arena == NULL)
+		free(mem);
+}
+
+/*
+ * Grow the storage for words geometrically (starting with the inline
+ * buffer) so that adding words doesn't need an allocation each time.
+ */
+static int grow_words(arena_t *arena, word_t **words, uint_fast32_t *capacity, uint_fast32_t size, word_t *buffer) {
+	uint_fast32_t new_capacity;
+	void *mem;
+
+	if (size < *capacity)
+		return OK;
+
+	if (*capacity >= UINT32_MAX / 2)
+		new_capacity = UINT32_MAX;
+	else
+		new_capacity = *capacity * 2;
+
+	if (*words == buffer || arena != NULL) {
+		mem = words_alloc(arena, sizeof(word_t) * new_capacity);
+		if (mem == NULL) return -ENOMEM;
+
+		memcpy(mem, *words, sizeof(word_t) * size);
+	} else {
+		mem = realloc(*words, sizeof(word_t) * new_capacity);
+		if (mem == NULL) return -ENOMEM;
+	}
+
+	*words = mem;
+	*capacity = new_capacity;
+	return OK;
+}
+
+dict_t *dict_alloc(arena_t *arena) {
 	dict_t *dict;
 
-	dict = malloc(sizeof(dict_t));
+	dict = words_alloc(arena, sizeof(dict_t));
 	if (dict == NULL) return NULL;
 
+	dict->arena = arena;
 	dict->size = 0;
-	dict->words = NULL;
+	dict->capacity = DICT_INLINE;
+	dict->words = dict->buffer;
 
 	return dict;
 }
@@ -242,7 +288,6 @@ dict_t *dict_alloc(void) {
 int dict_add(dict_t *dict, word_t word, uint32_t *pos) {
 	uint_fast32_t i;
 	uint32_t tmp;
-	void *mem;
 	int ret;
 
 	WARN_IF(dict == NULL);
@@ -255,14 +300,13 @@ int dict_add(dict_t *dict, word_t word, uint32_t *pos) {
 	if (dict->size >= UINT32_MAX)
 		return -ENOSPC;
 
+	ret = grow_words(dict->arena, &dict->words, &dict->capacity, dict->size, dict->buffer);
+	if (ret) return ret;
+
 	dict->size++;
 
 	BUG_IF(dict->size <= 0);
 
-	mem = realloc(dict->words, sizeof(word_t) * dict->size);
-	if (mem == NULL) { dict->size--; return -ENOMEM; }
-	dict->words = mem;
-
 	for (i = dict->size - 1; i > *pos; i--)
 		dict->words[i] = dict->words[i - 1];
 	dict->words[*pos] = word;
@@ -273,7 +317,6 @@ int dict_add(dict_t *dict, word_t word, uint32_t *pos) {
 int dict_del(dict_t *dict, word_t word, uint32_t *pos) {
 	uint_fast32_t i;
 	uint32_t tmp;
-	void *mem;
 	int ret;
 
 	WARN_IF(dict == NULL);
@@ -288,10 +331,6 @@ int dict_del(dict_t *dict, word_t word, uint32_t *pos) {
 	for (i = *pos; i < dict->size; i++)
 		dict->words[i] = dict->words[i + 1];
 
-	mem = realloc(dict->words, sizeof(word_t) * dict->size);
-	if (mem == NULL) return -ENOMEM;
-	dict->words = mem;
-
 	return OK;
 }
 
@@ -360,47 +399,72 @@ void dict_free(dict_t **dict) {
 	if (*dict == NULL) return;
 	dict_p = *dict;
 
-	free(dict_p->words);
-	free(*dict);
+	if (dict_p->words != dict_p->buffer)
+		words_free(dict_p->arena, dict_p->words);
+	words_free(dict_p->arena, *dict);
 	*dict = NULL;
 }
 
-list_t *list_alloc(void) {
+list_t *list_alloc(arena_t *arena) {
 	list_t *list;
 
-	list = malloc(sizeof(list_t));
+	list = words_alloc(arena, sizeof(list_t));
 	if (list == NULL) return NULL;
 
+	list->arena = arena;
+	list->head = 0;
 	list->size = 0;
-	list->words = NULL;
+	list->capacity = LIST_INLINE;
+	list->words = list->buffer;
 
 	return list;
 }
 
-int list_append(list_t *list, word_t word) {
-	void *mem;
-
-	WARN_IF(list == NULL);
-	WARN_IF(word == 0);
+/*
+ * Make space for another word at the front or the back of the list.
+ *
+ * The words are re-centred in the storage when it runs out at one end,
+ * so that both appending and prepending are O(1) amortised.
+ */
+static int list_reserve(list_t *list, int front) {
+	uint_fast32_t capacity = list->capacity;
+	uint_fast32_t head;
+	word_t *words;
+
+	if (front ? list->head > 0 : list->head + list->size < list->capacity)
+		return OK;
+
+	if (list->size >= capacity / 2) {
+		if (capacity >= UINT32_MAX / 2)
+			capacity = UINT32_MAX;
+		else
+			capacity *= 2;
+	}
 
-	if (list->size >= UINT32_MAX)
+	head = (capacity - list->size) / 2;
+	if (front ? head == 0 : head + list->size == capacity)
 		return -ENOSPC;
 
-	list->size++;
+	if (capacity == list->capacity) {
+		words = list->words;
+	} else {
+		words = words_alloc(list->arena, sizeof(word_t) * capacity);
+		if (words == NULL) return -ENOMEM;
+	}
 
-	BUG_IF(list->size <= 0);
+	memmove(&words[head], &list->words[list->head], sizeof(word_t) * list->size);
 
-	mem = realloc(list->words, sizeof(word_t) * list->size);
-	if (mem == NULL) { list->size--; return -ENOMEM; }
-	list->words = mem;
+	if (words != list->words && list->words != list->buffer)
+		words_free(list->arena, list->words);
 
-	list->words[list->size - 1] = word;
+	list->words = words;
+	list->capacity = capacity;
+	list->head = head;
 	return OK;
 }
 
-int list_prepend(list_t *list, word_t word) {
-	uint_fast32_t i;	
-	void *mem;
+int list_append(list_t *list, word_t word) {
+	int ret;
 
 	WARN_IF(list == NULL);
 	WARN_IF(word == 0);
@@ -408,18 +472,29 @@ int list_prepend(list_t *list, word_t word) {
 	if (list->size >= UINT32_MAX)
 		return -ENOSPC;
 
+	ret = list_reserve(list, 0);
+	if (ret) return ret;
+
+	list->words[list->head + list->size] = word;
 	list->size++;
+	return OK;
+}
 
-	BUG_IF(list->size <= 0);
+int list_prepend(list_t *list, word_t word) {
+	int ret;
+
+	WARN_IF(list == NULL);
+	WARN_IF(word == 0);
 
-	mem = realloc(list->words, sizeof(word_t) * list->size);
-	if (mem == NULL) { list->size--; return -ENOMEM; }
-	list->words = mem;
+	if (list->size >= UINT32_MAX)
+		return -ENOSPC;
 
-	for (i = 1; i < list->size; i++)
-		list->words[i] = list->words[i - 1];
+	ret = list_reserve(list, 1);
+	if (ret) return ret;
 
-	list->words[0] = word;
+	list->head--;
+	list->words[list->head] = word;
+	list->size++;
 	return OK;
 }
 
@@ -427,7 +502,7 @@ int list_get(const list_t *list, uint32_t pos, word_t *word) {
 	WARN_IF(list == NULL);
 	WARN_IF(word == NULL);
 	if (pos >= list->size) return -ENOTFOUND;
-	*word = list->words[pos];
+	*word = list->words[list->head + pos];
 	return OK;
 }
 
@@ -435,7 +510,7 @@ int list_set(list_t *list, uint32_t pos, word_t word) {
 	WARN_IF(list == NULL);
 	WARN_IF(word == 0);
 	if (pos >= list->size) return -ENOTFOUND;
-	list->words[pos] = word;
+	list->words[list->head + pos] = word;
 	return OK;
 }
 
@@ -456,7 +531,7 @@ int list_equal(const list_t *a, const list_t *b) {
 		return 0;
 
 	for (i = 0; i < a->size; i++)
-		if (a->words[i] != b->words[i])
+		if (a->words[a->head + i] != b->words[b->head + i])
 			return 0;
 
 	return 1;
@@ -468,7 +543,7 @@ int list_contains(const list_t *list, word_t word) {
 	WARN_IF(list == NULL);
 
 	for (i = 0; i < list->size; i++)
-		if (list->words[i] == word)
+		if (list->words[list->head + i] == word)
 			return OK;
 
 	return -ENOTFOUND;
@@ -480,8 +555,104 @@ void list_free(list_t **list) {
 	if (*list == NULL) return;
 	list_p = *list;
 
-	free(list_p->words);
-	free(*list);
+	if (list_p->words != list_p->buffer)
+		words_free(list_p->arena, list_p->words);
+	words_free(list_p->arena, *list);
 	*list = NULL;
 }
 
+
+set_t *set_alloc(arena_t *arena) {
+	set_t *set;
+
+	set = words_alloc(arena, sizeof(set_t));
+	if (set == NULL) return NULL;
+
+	set->arena = arena;
+	set->size = 0;
+	set->mask = SET_INLINE - 1;
+	set->words = set->buffer;
+	memset(set->buffer, 0, sizeof(set->buffer));
+
+	return set;
+}
+
+static inline uint_fast32_t set_hash(const set_t *set, word_t word) {
+	uint64_t hash = word * 0x9E3779B97F4A7C15ULL;
+	return (hash ^ (hash >> 32)) & set->mask;
+}
+
+static void set_insert(set_t *set, word_t word) {
+	uint_fast32_t slot = set_hash(set, word);
+
+	while (set->words[slot] != 0) {
+		if (set->words[slot] == word)
+			return;
+		slot = (slot + 1) & set->mask;
+	}
+
+	set->words[slot] = word;
+	set->size++;
+}
+
+int set_add(set_t *set, word_t word) {
+	WARN_IF(set == NULL);
+	WARN_IF(word == 0);
+
+	/* keep the table at most half full */
+	if (set->size >= (set->mask + 1) / 2) {
+		word_t *old = set->words;
+		uint_fast32_t old_size = set->mask + 1;
+		uint_fast32_t i;
+
+		if (set->mask >= UINT32_MAX / 2)
+			return -ENOSPC;
+
+		set->words = words_alloc(set->arena, sizeof(word_t) * old_size * 2);
+		if (set->words == NULL) {
+			set->words = old;
+			return -ENOMEM;
+		}
+		memset(set->words, 0, sizeof(word_t) * old_size * 2);
+		set->mask = old_size * 2 - 1;
+		set->size = 0;
+
+		for (i = 0; i < old_size; i++)
+			if (old[i] != 0)
+				set_insert(set, old[i]);
+
+		if (old != set->buffer)
+			words_free(set->arena, old);
+	}
+
+	set_insert(set, word);
+	return OK;
+}
+
+int set_contains(const set_t *set, word_t word) {
+	uint_fast32_t slot;
+
+	WARN_IF(set == NULL);
+	WARN_IF(word == 0);
+
+	slot = set_hash(set, word);
+	while (set->words[slot] != 0) {
+		if (set->words[slot] == word)
+			return OK;
+		slot = (slot + 1) & set->mask;
+	}
+
+	return -ENOTFOUND;
+}
+
+void set_free(set_t **set) {
+	set_t *set_p;
+
+	if (*set == NULL) return;
+	set_p = *set;
+
+	if (set_p->words != set_p->buffer)
+		words_free(set_p->arena, set_p->words);
+	words_free(set_p->arena, *set);
+	*set = NULL;
+}
@@ -48,12 +48,6 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	ret = db_begin();
-	if (ret) {
-		fprintf(stderr, "<Unable to begin database transaction (%d)>\n", ret);
-		return 1;
-	}
-
 	while (argc == 2 || text != NULL) {
 		if (text == NULL) {
 			if (fgets(buffer, 1024, stdin) == NULL) {
@@ -66,6 +60,13 @@ int main(int argc, char *argv[]) {
 		if (text != NULL && strlen(text) == 0)
 			text = NULL;
 
+		/* one transaction per line, so that other processes can learn concurrently */
+		ret = db_begin();
+		if (ret) {
+			fprintf(stderr, "<Unable to begin database transaction (%d)>\n", ret);
+			return 1;
+		}
+
 		reply = NULL;
 		ret = hal_text(name, text, &reply);
 		if (ret) {
@@ -78,6 +79,12 @@ int main(int argc, char *argv[]) {
 			reply = NULL;
 		}
 
+		ret = db_commit();
+		if (ret) {
+			fprintf(stderr, "<Unable to commit database transaction (%d)>\n", ret);
+			return 1;
+		}
+
 		text = NULL;
 	}
 
@@ -87,12 +94,6 @@ int main(int argc, char *argv[]) {
 			fprintf(stderr, "<Unable to rollback database transaction (%d)>\n", ret);
 			return 1;
 		}
-	} else {
-		ret = db_commit();
-		if (ret) {
-			fprintf(stderr, "<Unable to commit database transaction (%d)>\n", ret);
-			return 1;
-		}
 	}
 
 	ret = db_disconnect();
@@ -47,12 +47,6 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	ret = db_begin();
-	if (ret) {
-		fprintf(stderr, "<Unable to begin database transaction (%d)>\n", ret);
-		return 1;
-	}
-
 	while (argc == 2 || text != NULL) {
 		if (text == NULL) {
 			if (fgets(buffer, 1024, stdin) == NULL) {
@@ -65,6 +59,13 @@ int main(int argc, char *argv[]) {
 		if (text != NULL && strlen(text) == 0)
 			text = NULL;
 
+		/* one transaction per line, so that other processes can learn concurrently */
+		ret = db_begin();
+		if (ret) {
+			fprintf(stderr, "<Unable to begin database transaction (%d)>\n", ret);
+			return 1;
+		}
+
 		ret = learn_text(name, text);
 		if (ret) {
 			fprintf(stderr, "<Unable to learn text (%d)>\n", ret);
@@ -72,6 +73,12 @@ int main(int argc, char *argv[]) {
 			break;
 		}
 
+		ret = db_commit();
+		if (ret) {
+			fprintf(stderr, "<Unable to commit database transaction (%d)>\n", ret);
+			return 1;
+		}
+
 		text = NULL;
 	}
 
@@ -81,12 +88,6 @@ int main(int argc, char *argv[]) {
 			fprintf(stderr, "<Unable to rollback database transaction (%d)>\n", ret);
 			return 1;
 		}
-	} else {
-		ret = db_commit();
-		if (ret) {
-			fprintf(stderr, "<Unable to commit database transaction (%d)>\n", ret);
-			return 1;
-		}
 	}
 
 	ret = db_disconnect();
@@ -6,13 +6,14 @@
 
 #include "types.h"
 #include "err.h"
+#include "arena.h"
 #include "db.h"
 #include "dict.h"
 #include "model.h"
 #include "megahal.h"
 #include "output.h"
 
-static int megahal_learn(brain_t brain, list_t *input) {
+int megahal_learn(brain_t brain, list_t *input) {
 	uint_fast32_t i;
 	uint32_t size;
 	number_t order;
@@ -102,7 +103,32 @@ static int megahal_timeout(struct timespec start) {
 	return timeout <= 0;
 }
 
-static int megahal_reply(brain_t brain, list_t *input, list_t **output) {
+static int copy_list(arena_t *arena, const list_t *src, list_t **dst) {
+	uint_fast32_t i;
+	uint32_t size;
+	int ret;
+
+	*dst = list_alloc(arena);
+	if (*dst == NULL) return -ENOMEM;
+
+	ret = list_size(src, &size);
+	if (ret) return ret;
+
+	for (i = 0; i < size; i++) {
+		word_t word;
+
+		ret = list_get(src, i, &word);
+		if (ret) return ret;
+
+		ret = list_append(*dst, word);
+		if (ret) return ret;
+	}
+
+	return OK;
+}
+
+static int megahal_reply(arena_t *arena, brain_t brain, list_t *input, list_t **output) {
+	arena_t *scratch;
 	dict_t *keywords;
 	list_t *current;
 	struct timespec start;
@@ -112,27 +138,28 @@ static int megahal_reply(brain_t brain, list_t *input, list_t **output) {
 
 	*output = NULL;
 
-	ret = megahal_keywords(brain, input, &keywords);
+	ret = megahal_keywords(arena, brain, input, &keywords);
 	if (ret) return ret;
 
-	ret = megahal_generate(brain, NULL, output);
-	if (ret) {
-		dict_free(&keywords);
-		return ret;
-	}
+	ret = megahal_generate(arena, brain, NULL, output);
+	if (ret) return ret;
 
 	if (!list_equal(input, *output))
 		list_free(output);
 
 	ret = clock_gettime(CLOCK_MONOTONIC, &start);
-	if (ret) {
-			ret = -ECLOCK;
-			goto fail;
-	}
+	if (ret) return -ECLOCK;
+
+	/*
+	 * Candidate replies are generated in a scratch arena that is reset
+	 * each time, so only the best reply is kept.
+	 */
+	scratch = arena_alloc();
+	if (scratch == NULL) return -ENOMEM;
 
 	max_surprise = -1.0;
 	do {
-		ret = megahal_generate(brain, keywords, &current);
+		ret = megahal_generate(scratch, brain, keywords, &current);
 		if (ret) goto fail;
 
 		ret = megahal_evaluate(brain, keywords, current, &surprise);
@@ -140,96 +167,60 @@ static int megahal_reply(brain_t brain, list_t *input, list_t **output) {
 
 		if (surprise > max_surprise && !list_equal(input, current)) {
 			max_surprise = surprise;
-			list_free(output);
-			*output = current;
-		} else {
-			list_free(&current);
+
+			ret = copy_list(arena, current, output);
+			if (ret) goto fail;
 		}
-	} while(!megahal_timeout(start));
 
-	dict_free(&keywords);
+		arena_reset(scratch);
+	} while(!megahal_timeout(start));
 
+	arena_free(&scratch);
 	return OK;
 
 fail:
-	list_free(output);
-	dict_free(&keywords);
+	arena_free(&scratch);
+	*output = NULL;
 	return ret;
 }
 
 int megahal_process(brain_t brain, const char *input, char **output, uint8_t flags) {
-	list_t *words_in;
-	int ret;
+	arena_t *arena;
+	list_t *words_in = NULL;
+	int ret = OK;
 
-	if (input != NULL) {
-		char *tmp;
+	WARN_IF((flags & MEGAHAL_F_LEARN) != 0 && input == NULL);
+	if (output != NULL && input == NULL) BUG(); // TODO
 
-		tmp = strdup(input);
-		if (tmp == NULL) return -ENOMEM;
+	/* everything allocated while processing input is released at the end */
+	arena = arena_alloc();
+	if (arena == NULL) return -ENOMEM;
 
-		ret = megahal_parse(tmp, &words_in);
-		free(tmp);
-		if (ret) return ret;
-	} else {
-		words_in = NULL;
+	if (input != NULL) {
+		ret = megahal_parse(arena, input, &words_in);
+		if (ret) goto out;
 	}
 
 	if ((flags & MEGAHAL_F_LEARN) != 0) {
-		WARN_IF(words_in == NULL);
-
 		ret = megahal_learn(brain, words_in);
-		if (ret) {
-			list_free(&words_in);
-			return ret;
-		}
+		if (ret) goto out;
 	}
 
 	if (output != NULL) {
 		list_t *words_out;
 
-		if (words_in == NULL) BUG(); // TODO
-
-		ret = megahal_reply(brain, words_in, &words_out);
-		list_free(&words_in);
-		if (ret) return ret;
+		ret = megahal_reply(arena, brain, words_in, &words_out);
+		if (ret) goto out;
 
 		if (words_out == NULL) {
 			*output = strdup("I don't know enough to answer you yet!");
-			if (*output == NULL) return -ENOMEM;
+			if (*output == NULL) ret = -ENOMEM;
 		} else {
 			ret = megahal_output(words_out, output);
-			list_free(&words_out);
-			if (ret) return ret;
 		}
-	} else {
-		list_free(&words_in);
 	}
-	return OK;
-}
-
-int megahal_train(brain_t brain, const char *filename) {
-	FILE *fd;
-	char buffer[1024];
-	char *string;
-	int ret = OK;
-
-	WARN_IF(filename == NULL);
-
-	fd = fopen(filename, "r");
-	if (fd == NULL) return -EIO;
 
-	while (!feof(fd)) {
-		if (fgets(buffer, 1024, fd) == NULL) break;
-		if (buffer[0] == '#') continue;
-		string = strtok(buffer, "\r\n");
-
-		if (string && strlen(string) > 0) {
-			ret = megahal_process(brain, buffer, NULL, MEGAHAL_F_LEARN);
-			if (ret) goto fail;
-		}
-	}
-
-fail:
-	fclose(fd);
+out:
+	arena_free(&arena);
 	return ret;
 }
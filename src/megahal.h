@@ -1,12 +1,24 @@
 #define MEGAHAL_DEFAULT_ORDER 5
 #define MEGAHAL_TIMEOUT_NS 1000000000
 #define MEGAHAL_F_LEARN 0x01
+#define MEGAHAL_F_BULK  0x02
+#define MEGAHAL_MAX_THREADS 256
+
+typedef struct {
+	uint32_t count; /* number of words */
+	size_t len;     /* length of text */
+	size_t size;    /* allocated size of text */
+	char *text;     /* upper case words (each one NUL terminated) */
+} tokens_t;
 
 int megahal_process(brain_t brain, const char *input, char **output, uint8_t flags);
-int megahal_train(brain_t brain, const char *filename);
+int megahal_learn(brain_t brain, list_t *input);
+int megahal_train(brain_t brain, const char *filename, unsigned int threads, uint8_t flags);
 
-int megahal_parse(const char *string, list_t **words);
-int megahal_keywords(brain_t brain, const list_t *words, dict_t **keywords);
-int megahal_generate(brain_t brain, const dict_t *keywords, list_t **words);
+int megahal_tokenise(const char *string, tokens_t *tokens); /* split into words (without database access) */
+int megahal_resolve(arena_t *arena, const tokens_t *tokens, list_t **words);
+int megahal_parse(arena_t *arena, const char *string, list_t **words);
+int megahal_keywords(arena_t *arena, brain_t brain, const list_t *words, dict_t **keywords);
+int megahal_generate(arena_t *arena, brain_t brain, const dict_t *keywords, list_t **words);
 int megahal_evaluate(brain_t brain, const dict_t *keywords, const list_t *words, double *surprise);
 int megahal_output(const list_t *words, char **string);
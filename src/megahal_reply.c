@@ -36,11 +36,8 @@ static int seed(brain_t brain, const model_t *model, const dict_t *keywords, wor
 			if (ret) return ret;
 
 			ret = db_model_contains(brain, tmp);
-			BUG_IF(ret != OK);
-/*
 			if (ret == -ENOTFOUND) continue;
 			if (ret != OK) return ret;
-*/
 
 			ret = db_list_contains(brain, LIST_AUX, tmp);
 			if (ret == OK) continue;
@@ -54,7 +51,7 @@ static int seed(brain_t brain, const model_t *model, const dict_t *keywords, wor
 	return OK;
 }
 
-static int babble(brain_t brain, const model_t *model, const dict_t *keywords, const list_t *words, int *use_aux, word_t *word) {
+static int babble(brain_t brain, const model_t *model, const dict_t *keywords, const set_t *used, int *use_aux, word_t *word) {
 	model_rand_t state;
 	int ret;
 
@@ -81,7 +78,7 @@ static int babble(brain_t brain, const model_t *model, const dict_t *keywords, c
 			if (ret != -ENOTFOUND) goto fail;
 		}
 
-		ret = list_contains(words, *word);
+		ret = set_contains(used, *word);
 		if (ret == OK) continue;
 		if (ret != -ENOTFOUND) goto fail;
 
@@ -99,10 +96,11 @@ fail:
 	return ret;
 }
 
-int megahal_generate(brain_t brain, const dict_t *keywords, list_t **words) {
+int megahal_generate(arena_t *arena, brain_t brain, const dict_t *keywords, list_t **words) {
 	number_t order;
 	model_t *model;
 	list_t *words_p;
+	set_t *used = NULL;
 	uint32_t size;
 	int start = 1;
 	int use_aux = 0;
@@ -114,10 +112,14 @@ int megahal_generate(brain_t brain, const dict_t *keywords, list_t **words) {
 	ret = model_alloc(brain, &model);
 	if (ret) goto fail;
 
-	*words = list_alloc();
+	*words = list_alloc(arena);
 	if (*words == NULL) return -ENOMEM;
 	words_p = *words;
 
+	/* words already in the reply */
+	used = set_alloc(arena);
+	if (used == NULL) { ret = -ENOMEM; goto fail; }
+
 	/* Generate the reply in the forward direction. */
 	ret = model_init(model, MODEL_FORWARD);
 	if (ret) goto fail;
@@ -132,7 +134,7 @@ int megahal_generate(brain_t brain, const dict_t *keywords, list_t **words) {
 			if (ret != OK) goto fail;
 			start = 0;
 		} else {
-			ret = babble(brain, model, keywords, words_p, &use_aux, &word);
+			ret = babble(brain, model, keywords, used, &use_aux, &word);
 			if (ret == -ENOTFOUND) break;
 			if (ret != OK) goto fail;
 
@@ -146,6 +148,9 @@ int megahal_generate(brain_t brain, const dict_t *keywords, list_t **words) {
 		ret = list_append(words_p, word);
 		if (ret) goto fail;
 
+		ret = set_add(used, word);
+		if (ret) goto fail;
+
 		/* Extend the current context of the model with the current symbol. */
 		ret = model_update(model, word, 0);
 		if (ret) goto fail;
@@ -181,7 +186,7 @@ int megahal_generate(brain_t brain, const dict_t *keywords, list_t **words) {
 		word_t word;
 
 		/* Get a random symbol from the current context. */
-		ret = babble(brain, model, keywords, words_p, &use_aux, &word);
+		ret = babble(brain, model, keywords, used, &use_aux, &word);
 		if (ret == -ENOTFOUND) break;
 		if (ret != OK) goto fail;
 
@@ -194,14 +199,20 @@ int megahal_generate(brain_t brain, const dict_t *keywords, list_t **words) {
 		ret = list_prepend(words_p, word);
 		if (ret) goto fail;
 
+		ret = set_add(used, word);
+		if (ret) goto fail;
+
 		/* Extend the current context of the model with the current symbol. */
 		ret = model_update(model, word, 0);
 		if (ret) goto fail;
 	}
 
+	set_free(&used);
+	model_free(&model);
 	return OK;
 
 fail:
+	set_free(&used);
 	list_free(words);
 	model_free(&model);
 	return ret;
@@ -1,43 +1,49 @@
 #define _GNU_SOURCE
 
-#include <ctype.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
 #include "types.h"
 #include "err.h"
+#include "arena.h"
 #include "db.h"
 #include "dict.h"
 #include "megahal.h"
 
-static void megahal_capitalise(char *string) {
-	size_t i, len;
-	int start = 1;
-
-	if (string == NULL) return;
-	len = strlen(string);
-
-	for (i = 0; i < len; i++) {
-		if (isalpha((unsigned char)string[i])) {
-			if (start) string[i] = (unsigned char)toupper((unsigned char)string[i]);
-			else string[i] = (unsigned char)tolower((unsigned)string[i]);
-			start = 0;
-		}
-		if ((i > 2) && (strchr("!.?", (unsigned char)string[i-1]) != NULL) && (isspace((unsigned char)string[i])))
-			start = 1;
-	}
-}
-
-static void megahal_upper(char *string) {
-	size_t i, len;
-
-	if (string == NULL) return;
-	len = strlen(string);
-
-	for (i = 0; i < len; i++)
-		string[i] = (unsigned char)toupper((unsigned char)string[i]);
-}
+#define CHAR_ALPHA 0x01
+#define CHAR_DIGIT 0x02
+#define CHAR_ALNUM (CHAR_ALPHA | CHAR_DIGIT)
+#define CHAR_SPACE 0x04
+#define CHAR_TERM  0x08
+
+/*
+ * Character classes (the same as the C locale, regardless of the
+ * current locale). Letters are folded by toggling the case bit.
+ */
+static const uint8_t char_class[256] = {
+	['0' ... '9'] = CHAR_DIGIT,
+	['A' ... 'Z'] = CHAR_ALPHA,
+	['a' ... 'z'] = CHAR_ALPHA,
+	[' '] = CHAR_SPACE,
+	['\t' ... '\r'] = CHAR_SPACE,
+	['!'] = CHAR_TERM,
+	['.'] = CHAR_TERM,
+	['?'] = CHAR_TERM
+};
+
+#define char_is(c, type) ((char_class[(unsigned char)(c)] & (type)) != 0)
+#define is_alpha(c) char_is(c, CHAR_ALPHA)
+#define is_digit(c) char_is(c, CHAR_DIGIT)
+#define is_alnum(c) char_is(c, CHAR_ALNUM)
+#define to_upper(c) (is_alpha(c) ? (char)((c) & ~0x20) : (c))
+#define to_lower(c) (is_alpha(c) ? (char)((c) | 0x20) : (c))
 
 /* Return whether or not a word boundary exists in a string at the specified location. */
 static int boundary(const char *string, uint_fast32_t position, uint_fast32_t len) {
@@ -49,267 +55,391 @@ static int boundary(const char *string, uint_fast32_t position, uint_fast32_t le
 
 	if (
 		(string[position] == '\'')
-		&& (isalpha((unsigned char)string[position - 1]) != 0)
-		&& (isalpha((unsigned char)string[position + 1]) != 0)
+		&& is_alpha(string[position - 1])
+		&& is_alpha(string[position + 1])
 	)
 		return 0;
 
 	if (
 		(position > 1)
 		&& (string[position-1] == '\'')
-		&& (isalpha((unsigned char)string[position - 2]) != 0)
-		&& (isalpha((unsigned char)string[position]) != 0)
+		&& is_alpha(string[position - 2])
+		&& is_alpha(string[position])
 	)
 		return 0;
 
 	if (
-		(isalpha((unsigned char)string[position]) != 0)
-		&& (isalpha((unsigned char)string[position - 1]) == 0)
+		is_alpha(string[position])
+		&& !is_alpha(string[position - 1])
 	)
 		return 1;
 
 	if (
-		(isalpha((unsigned char)string[position]) == 0)
-		&& (isalpha((unsigned char)string[position - 1]) != 0)
+		!is_alpha(string[position])
+		&& is_alpha(string[position - 1])
 	)
 		return 1;
 
-	if (isdigit((unsigned char)string[position])
-		!= isdigit((unsigned char)string[position - 1])
-	)
+	if (is_digit(string[position]) != is_digit(string[position - 1]))
 		return 1;
 
 	return 0;
 }
 
-int megahal_parse(const char *string, list_t **words) {
-	list_t *words_p;
-	uint_fast32_t offset, len;
-	uint32_t size;
-	word_t word;
-	char *tmp;
-	int ret;
+#if defined(__AVX2__)
+static inline __m256i class_avx2(const char *string) {
+	__m256i c = _mm256_loadu_si256((const __m256i *)string);
+	__m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+	__m256i alpha = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), _mm256_add_epi8(lower, _mm256_set1_epi8(128 - 'a')));
+	__m256i digit = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 10), _mm256_add_epi8(c, _mm256_set1_epi8(128 - '0')));
 
-	WARN_IF(string == NULL);
-	WARN_IF(words == NULL);
+	return _mm256_or_si256(
+		_mm256_and_si256(alpha, _mm256_set1_epi8(CHAR_ALPHA)),
+		_mm256_and_si256(digit, _mm256_set1_epi8(CHAR_DIGIT)));
+}
+#elif defined(__SSE2__)
+static inline __m128i class_sse2(const char *string) {
+	__m128i c = _mm_loadu_si128((const __m128i *)string);
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i alpha = _mm_cmplt_epi8(_mm_add_epi8(lower, _mm_set1_epi8(128 - 'a')), _mm_set1_epi8(-128 + 26));
+	__m128i digit = _mm_cmplt_epi8(_mm_add_epi8(c, _mm_set1_epi8(128 - '0')), _mm_set1_epi8(-128 + 10));
+
+	return _mm_or_si128(
+		_mm_and_si128(alpha, _mm_set1_epi8(CHAR_ALPHA)),
+		_mm_and_si128(digit, _mm_set1_epi8(CHAR_DIGIT)));
+}
+#endif
+
+/*
+ * Skip over characters that have the same class as the previous character,
+ * there can't be a word boundary at any of them. Returns the position of the
+ * next change of class (or the end of the string).
+ */
+static uint_fast32_t skip_class(const char *string, uint_fast32_t position, uint_fast32_t len) {
+#if defined(__AVX2__)
+	while (position + 32 <= len) {
+		uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			class_avx2(&string[position]), class_avx2(&string[position - 1])));
+
+		if (mask != 0)
+			return position + __builtin_ctz(mask);
+		position += 32;
+	}
+#elif defined(__SSE2__)
+	while (position + 16 <= len) {
+		uint32_t mask = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+			class_sse2(&string[position]), class_sse2(&string[position - 1]))) & 0xFFFF;
+
+		if (mask != 0)
+			return position + __builtin_ctz(mask);
+		position += 16;
+	}
+#endif
 
-	*words = list_alloc();
-	if (*words == NULL) return -ENOMEM;
-	words_p = *words;
+	while (position < len
+			&& (char_class[(unsigned char)string[position]] & CHAR_ALNUM)
+				== (char_class[(unsigned char)string[position - 1]] & CHAR_ALNUM))
+		position++;
 
-	len = strlen(string);
-	if (len == 0) return OK;
+	return position;
+}
+
+/*
+ * Split a string into words in a single pass, calling back with the
+ * offset and length of each word.
+ */
+static int megahal_split(const char *string, uint_fast32_t len,
+		int (*callback)(void *data, uint_fast32_t offset, uint_fast32_t length),
+		void *data) {
+	uint_fast32_t start, offset;
+	int ret;
+
+	start = 0;
+	for (offset = 1; offset <= len; offset++) {
+		offset = skip_class(string, offset, len);
 
-	offset = 0;
-	while (1) {
 		/*
 		 * If the current character is of the same type as the previous
 		 * character, then include it in the word. Otherwise, terminate
 		 * the current word.
 		 */
 		if (boundary(string, offset, len)) {
-			/*
-			 * Add the word to the dictionary
-			 */
-			tmp = strndup(string, offset);
-			if (tmp == NULL) return -ENOMEM;
-
-			/*
-			 * Truncate overly long words because they won't fit in the
-			 * dictionary when saving.
-			 */
-			if (offset > UINT8_MAX)
-				tmp[UINT8_MAX + 1] = 0;
-			megahal_upper(tmp);
-
-			ret = db_word_use(tmp, &word);
-			free(tmp);
+			ret = callback(data, start, offset - start);
 			if (ret) return ret;
 
-			ret = list_append(words_p, word);
-			if (ret) return ret;
-
-			if (offset == len) break;
-			string += offset;
-			len = strlen(string);
-			offset = 0;
-		} else {
-			offset++;
+			start = offset;
 		}
 	}
 
-	/*
-	 * If the last word isn't punctuation, then replace it with a
-	 * full-stop character.
-	 */
-	tmp = NULL;
-	ret = list_size(words_p, &size);
-	if (ret) return ret;
+	return OK;
+}
 
-	ret = list_get(words_p, size - 1, &word);
-	if (ret) return ret;
+typedef struct {
+	const char *string;
+	tokens_t *tokens;
+} tokenise_t;
 
-	ret = db_word_str(word, &tmp);
-	if (ret) return ret;
+static int tokenise_word(void *data_, uint_fast32_t offset, uint_fast32_t length) {
+	tokenise_t *data = data_;
+	tokens_t *tokens = data->tokens;
+	uint_fast32_t i;
+	char *word;
 
-	if (isalnum((unsigned char)tmp[0])) {
-		free(tmp);
+	/*
+	 * Truncate overly long words because they won't fit in the
+	 * dictionary when saving.
+	 */
+	if (length > UINT8_MAX)
+		length = UINT8_MAX;
 
-		ret = db_word_use(".", &word);
-		if (ret) return ret;
+	if (tokens->len + length + 1 > tokens->size) {
+		size_t size = tokens->size > 0 ? tokens->size : 256;
+		void *mem;
 
-		ret = list_append(words_p, word);
-		if (ret) return ret;
-	} else if (strchr("!.?", (unsigned char)tmp[strlen(tmp) - 1]) == NULL) {
-		free(tmp);
+		while (tokens->len + length + 1 > size)
+			size *= 2;
 
-		ret = db_word_use(".", &word);
-		if (ret) return ret;
+		mem = realloc(tokens->text, sizeof(char) * size);
+		if (mem == NULL) return -ENOMEM;
 
-		ret = list_set(words_p, size - 1, word);
-		if (ret) return ret;
-	} else {
-		free(tmp);
+		tokens->text = mem;
+		tokens->size = size;
 	}
 
+	word = &tokens->text[tokens->len];
+	for (i = 0; i < length; i++)
+		word[i] = to_upper(data->string[offset + i]);
+	word[length] = 0;
+
+	tokens->len += length + 1;
+	tokens->count++;
 	return OK;
 }
 
-static int add_keyword(dict_t *keywords, word_t word) {
-	int ret;
-	char *tmp;
+int megahal_tokenise(const char *string, tokens_t *tokens) {
+	tokenise_t data;
 
-	ret = db_word_str(word, &tmp);
-	if (ret) return ret;
+	WARN_IF(string == NULL);
+	WARN_IF(tokens == NULL);
+
+	tokens->count = 0;
+	tokens->len = 0;
 
-	if (isalnum((unsigned char)tmp[0]) != 0)
-		ret = dict_add(keywords, word, NULL);
+	data.string = string;
+	data.tokens = tokens;
 
-	free(tmp);
-	return ret;
+	return megahal_split(string, strlen(string), tokenise_word, &data);
 }
 
-int megahal_keywords(brain_t brain, const list_t *words, dict_t **keywords) {
-	dict_t *keywords_p;
+int megahal_resolve(arena_t *arena, const tokens_t *tokens, list_t **words) {
 	uint_fast32_t i;
+	size_t pos;
+	uint8_t flags = 0;
 	uint32_t size;
+	word_t word;
 	int ret;
 
+	WARN_IF(tokens == NULL);
 	WARN_IF(words == NULL);
-	WARN_IF(keywords == NULL);
 
-	*keywords = dict_alloc();
-	if (*keywords == NULL) return -ENOMEM;
-	keywords_p = *keywords;
+	*words = list_alloc(arena);
+	if (*words == NULL) return -ENOMEM;
 
-	ret = list_size(words, &size);
-	if (ret) return ret;
+	/*
+	 * Add the words to the dictionary
+	 */
+	for (i = 0, pos = 0; i < tokens->count; i++) {
+		const char *text = &tokens->text[pos];
 
-	for (i = 0; i < size; i++) {
-		word_t word;
+		ret = db_word_use(text, &word, &flags);
+		if (ret) return ret;
 
-		ret = list_get(words, i, &word);
+		ret = list_append(*words, word);
 		if (ret) return ret;
 
-		ret = db_map_get(brain, MAP_SWAP, word, &word);
-		if (ret != OK && ret != -ENOTFOUND) return ret;
+		pos += strlen(text) + 1;
+	}
 
-		ret = db_list_contains(brain, LIST_BAN, word);
-		if (ret == OK) continue;
-		if (ret != -ENOTFOUND) return ret;
+	ret = list_size(*words, &size);
+	if (ret) return ret;
 
-		ret = db_list_contains(brain, LIST_AUX, word);
-		if (ret == OK) continue;
-		if (ret != -ENOTFOUND) return ret;
+	if (size == 0) return OK;
 
-		ret = db_model_contains(brain, word);
-		if (ret == -ENOTFOUND) continue;
-		if (ret != OK) return ret;
+	/*
+	 * If the last word isn't punctuation, then replace it with a
+	 * full-stop character.
+	 */
+	if (flags & DB_WORD_F_ALNUM) {
+		ret = db_word_use(".", &word, NULL);
+		if (ret) return ret;
+
+		ret = list_append(*words, word);
+		if (ret) return ret;
+	} else if (!(flags & DB_WORD_F_TERM)) {
+		ret = db_word_use(".", &word, NULL);
+		if (ret) return ret;
 
-		ret = add_keyword(keywords_p, word);
+		ret = list_set(*words, size - 1, word);
 		if (ret) return ret;
 	}
 
-	ret = dict_size(keywords_p, &size);
-	if (ret) return ret;
+	return OK;
+}
 
-	if (size == 0)
-		return OK;
+int megahal_parse(arena_t *arena, const char *string, list_t **words) {
+	tokens_t tokens;
+	size_t len;
+	int ret;
 
-	ret = list_size(words, &size);
+	WARN_IF(arena == NULL);
+	WARN_IF(string == NULL);
+	WARN_IF(words == NULL);
+
+	/*
+	 * There can't be more words than characters, so the text of the
+	 * words will always fit in twice the length of the string.
+	 */
+	len = strlen(string);
+	tokens.size = len * 2 + 1;
+	tokens.text = arena_get(arena, tokens.size);
+	if (tokens.text == NULL) return -ENOMEM;
+
+	ret = megahal_tokenise(string, &tokens);
 	if (ret) return ret;
 
-	for (i = 0; i < size; i++) {
-		word_t word;
+	return megahal_resolve(arena, &tokens, words);
+}
 
-		ret = list_get(words, i, &word);
-		if (ret) return ret;
+typedef struct {
+	word_t *words;
+	uint8_t *flags;
+	uint32_t len;
+} keywords_t;
 
-		ret = db_map_get(brain, MAP_SWAP, word, &word);
-		if (ret != OK && ret != -ENOTFOUND) return ret;
+static int keywords_word(void *data_, word_t word, uint8_t flags) {
+	keywords_t *data = data_;
 
-		ret = db_list_contains(brain, LIST_AUX, word);
-		if (ret == -ENOTFOUND) continue;
-		if (ret != OK) return ret;
+	data->words[data->len] = word;
+	data->flags[data->len] = flags;
+	data->len++;
+	return OK;
+}
+
+static int keywords_add(dict_t *keywords, const keywords_t *data, uint8_t mask, uint8_t want) {
+	uint_fast32_t i;
+	int ret;
 
-		ret = db_model_contains(brain, word);
-		if (ret == -ENOTFOUND) continue;
-		if (ret != OK) return ret;
+	for (i = 0; i < data->len; i++) {
+		if ((data->flags[i] & mask) != want) continue;
 
-		ret = add_keyword(keywords_p, word);
+		ret = dict_add(keywords, data->words[i], NULL);
 		if (ret) return ret;
 	}
 
 	return OK;
 }
 
-int megahal_output(const list_t *words, char **string) {
-	size_t len = 0;
-	uint_fast32_t i;
+int megahal_keywords(arena_t *arena, brain_t brain, const list_t *words, dict_t **keywords) {
+	keywords_t data;
 	uint32_t size;
 	int ret;
-	void *mem;
 
+	WARN_IF(arena == NULL);
 	WARN_IF(words == NULL);
-	WARN_IF(string == NULL);
-	WARN_IF(*string != NULL);
+	WARN_IF(keywords == NULL);
+
+	*keywords = dict_alloc(arena);
+	if (*keywords == NULL) return -ENOMEM;
 
 	ret = list_size(words, &size);
 	if (ret) return ret;
 
-	*string = malloc(sizeof(char) * (len + 1));
-	if (*string == NULL) return -ENOMEM;
-	(*string)[0] = 0;
+	if (size == 0)
+		return OK;
 
-	for (i = 0; i < size; i++) {
-		word_t word;
-		size_t tmp_len;
-		char *tmp;
+	data.words = arena_get(arena, sizeof(word_t) * size);
+	data.flags = arena_get(arena, sizeof(uint8_t) * size);
+	data.len = 0;
+	if (data.words == NULL || data.flags == NULL)
+		return -ENOMEM;
 
-		ret = list_get(words, i, &word);
-		if (ret) return ret;
+	ret = db_model_keywords(brain, words, keywords_word, &data);
+	if (ret) return ret;
+
+	ret = keywords_add(*keywords, &data,
+		DB_KEYWORD_F_BAN|DB_KEYWORD_F_AUX|DB_KEYWORD_F_MODEL|DB_KEYWORD_F_ALNUM,
+		DB_KEYWORD_F_MODEL|DB_KEYWORD_F_ALNUM);
+	if (ret) return ret;
+
+	ret = dict_size(*keywords, &size);
+	if (ret) return ret;
 
-		ret = db_word_str(word, &tmp);
+	if (size > 0) {
+		ret = keywords_add(*keywords, &data,
+			DB_KEYWORD_F_AUX|DB_KEYWORD_F_MODEL|DB_KEYWORD_F_ALNUM,
+			DB_KEYWORD_F_AUX|DB_KEYWORD_F_MODEL|DB_KEYWORD_F_ALNUM);
 		if (ret) return ret;
+	}
+
+	return OK;
+}
+
+typedef struct {
+	char *string;
+	size_t len;
+	int start;
+} output_t;
+
+static int output_alloc(void *data_, number_t length) {
+	output_t *data = data_;
+
+	data->string = malloc(sizeof(char) * (length + 1));
+	if (data->string == NULL) return -ENOMEM;
+
+	return OK;
+}
 
-		tmp_len = strlen(tmp);
+/* Append a word to the output, capitalising the start of each sentence. */
+static int output_word(void *data_, const char *word, size_t len) {
+	output_t *data = data_;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		char c = word[i];
 
-		mem = realloc(*string, sizeof(char) * (len + tmp_len + 1));
-		if (mem == NULL) {
-			free(*string);
-			*string = NULL;
-			free(tmp);
-			return -ENOMEM;
+		if (is_alpha(c)) {
+			if (data->start) c = to_upper(c);
+			else c = to_lower(c);
+			data->start = 0;
 		}
-		*string = mem;
-		(*string)[len + tmp_len] = 0;
+		if ((data->len > 2) && char_is(data->string[data->len - 1], CHAR_TERM) && char_is(c, CHAR_SPACE))
+			data->start = 1;
+
+		data->string[data->len++] = c;
+	}
+
+	return OK;
+}
+
+int megahal_output(const list_t *words, char **string) {
+	output_t data;
+	int ret;
+
+	WARN_IF(words == NULL);
+	WARN_IF(string == NULL);
+	WARN_IF(*string != NULL);
 
-		strcat(&(*string)[len], tmp);
-		len += tmp_len;
+	data.string = NULL;
+	data.len = 0;
+	data.start = 1;
 
-		free(tmp);
+	ret = db_word_strs(words, output_alloc, output_word, &data);
+	if (ret) {
+		free(data.string);
+		return ret;
 	}
 
-	megahal_capitalise(*string);
+	data.string[data.len] = 0;
+	*string = data.string;
 	return OK;
 }
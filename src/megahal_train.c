@@ -0,0 +1,371 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "types.h"
+#include "err.h"
+#include "arena.h"
+#include "db.h"
+#include "dict.h"
+#include "megahal.h"
+#include "model.h"
+#include "output.h"
+
+#define TRAIN_BATCH_LINES 256   /* lines passed between stages at a time */
+#define TRAIN_THREAD_BATCHES 4  /* batches queued per tokeniser thread */
+#define TRAIN_REPORT_NS 10000000000LL
+
+enum batch_state {
+	BATCH_FREE,
+	BATCH_READ,
+	BATCH_TOKENISING,
+	BATCH_DONE
+};
+
+typedef struct {
+	enum batch_state state;
+	uint_fast32_t lines;
+
+	/* input lines (each one NUL terminated) */
+	size_t offset[TRAIN_BATCH_LINES];
+	size_t len;
+	size_t size;
+	char *text;
+
+	tokens_t tokens[TRAIN_BATCH_LINES];
+} batch_t;
+
+/*
+ * Training pipeline: a reader thread fills batches of lines, tokeniser
+ * threads split them into words and the learner (the calling thread,
+ * which owns the database connection) resolves and learns each batch in
+ * the order it was read.
+ *
+ * Batches are used as a ring buffer indexed by sequence number, so the
+ * queues are bounded by the number of batches.
+ */
+typedef struct {
+	FILE *fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	batch_t *batches;
+	uint_fast32_t count;
+
+	uint64_t read;      /* number of batches read */
+	uint64_t tokenised; /* number of batches claimed by tokenisers */
+	uint64_t learnt;    /* number of batches learnt */
+	int eof;
+	int stop;
+	int ret;
+} train_t;
+
+static void train_stop(train_t *data, int ret) {
+	pthread_mutex_lock(&data->lock);
+	if (data->ret == OK)
+		data->ret = ret;
+	data->stop = 1;
+	pthread_cond_broadcast(&data->cond);
+	pthread_mutex_unlock(&data->lock);
+}
+
+static int train_append(batch_t *batch, const char *string) {
+	size_t len = strlen(string) + 1;
+
+	if (batch->len + len > batch->size) {
+		size_t size = batch->size > 0 ? batch->size : 4096;
+		void *mem;
+
+		while (batch->len + len > size)
+			size *= 2;
+
+		mem = realloc(batch->text, sizeof(char) * size);
+		if (mem == NULL) return -ENOMEM;
+
+		batch->text = mem;
+		batch->size = size;
+	}
+
+	memcpy(&batch->text[batch->len], string, len);
+	batch->offset[batch->lines++] = batch->len;
+	batch->len += len;
+	return OK;
+}
+
+static void *train_reader(void *data_) {
+	train_t *data = data_;
+	char *line = NULL;
+	size_t line_size = 0;
+	int ret = OK;
+
+	for (;;) {
+		batch_t *batch;
+		ssize_t len = 0;
+		int eof = 0;
+
+		pthread_mutex_lock(&data->lock);
+		while (!data->stop && data->read - data->learnt >= data->count)
+			pthread_cond_wait(&data->cond, &data->lock);
+		if (data->stop) {
+			pthread_mutex_unlock(&data->lock);
+			break;
+		}
+		batch = &data->batches[data->read % data->count];
+		pthread_mutex_unlock(&data->lock);
+
+		batch->lines = 0;
+		batch->len = 0;
+
+		while (batch->lines < TRAIN_BATCH_LINES) {
+			char *string;
+
+			len = getline(&line, &line_size, data->fd);
+			if (len < 0) {
+				if (ferror(data->fd)) ret = -EIO;
+				eof = 1;
+				break;
+			}
+
+			if (line[0] == '#') continue;
+			string = &line[strspn(line, "\r\n")];
+			string[strcspn(string, "\r\n")] = 0;
+
+			if (string[0] != 0) {
+				ret = train_append(batch, string);
+				if (ret) break;
+			}
+		}
+
+		if (ret) {
+			train_stop(data, ret);
+			break;
+		}
+
+		pthread_mutex_lock(&data->lock);
+		if (batch->lines > 0) {
+			batch->state = BATCH_READ;
+			data->read++;
+		}
+		data->eof = eof;
+		pthread_cond_broadcast(&data->cond);
+		pthread_mutex_unlock(&data->lock);
+
+		if (eof) break;
+	}
+
+	free(line);
+	return NULL;
+}
+
+static void *train_tokeniser(void *data_) {
+	train_t *data = data_;
+
+	for (;;) {
+		batch_t *batch;
+		uint_fast32_t i;
+		int ret = OK;
+
+		pthread_mutex_lock(&data->lock);
+		while (!data->stop && !data->eof && data->tokenised == data->read)
+			pthread_cond_wait(&data->cond, &data->lock);
+		if (data->stop || data->tokenised == data->read) {
+			pthread_mutex_unlock(&data->lock);
+			break;
+		}
+		batch = &data->batches[data->tokenised % data->count];
+		batch->state = BATCH_TOKENISING;
+		data->tokenised++;
+		pthread_mutex_unlock(&data->lock);
+
+		for (i = 0; i < batch->lines; i++) {
+			ret = megahal_tokenise(&batch->text[batch->offset[i]], &batch->tokens[i]);
+			if (ret) break;
+		}
+
+		if (ret) {
+			train_stop(data, ret);
+			break;
+		}
+
+		pthread_mutex_lock(&data->lock);
+		batch->state = BATCH_DONE;
+		pthread_cond_broadcast(&data->cond);
+		pthread_mutex_unlock(&data->lock);
+	}
+
+	return NULL;
+}
+
+static int train_learn(arena_t *arena, brain_t brain, model_bulk_t *bulk, batch_t *batch) {
+	uint_fast32_t i;
+	int ret;
+
+	for (i = 0; i < batch->lines; i++) {
+		list_t *words;
+
+		ret = megahal_resolve(arena, &batch->tokens[i], &words);
+		if (ret == OK) {
+			if (bulk != NULL)
+				ret = model_bulk_learn(bulk, words);
+			else
+				ret = megahal_learn(brain, words);
+		}
+		arena_reset(arena);
+		if (ret) return ret;
+	}
+
+	return OK;
+}
+
+static int64_t train_elapsed(const struct timespec *start) {
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return 0;
+
+	return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+static void train_report(uint64_t lines, int64_t elapsed) {
+	char msg[128];
+	double secs = elapsed / 1000000000.0;
+
+	snprintf(msg, sizeof(msg), "%llu lines in %.1fs (%.0f lines/s)",
+		(unsigned long long int)lines, secs, secs > 0 ? lines / secs : 0.0);
+	log_info("megahal_train", OK, msg);
+}
+
+int megahal_train(brain_t brain, const char *filename, unsigned int threads, uint8_t flags) {
+	train_t data;
+	model_bulk_t *bulk = NULL;
+	arena_t *arena = NULL;
+	pthread_t reader;
+	pthread_t *tokenisers = NULL;
+	unsigned int started = 0;
+	uint_fast32_t i;
+	struct timespec start;
+	int64_t reported = 0;
+	uint64_t lines = 0;
+	int ret;
+
+	WARN_IF(filename == NULL);
+
+	if (threads == 0)
+		threads = 1;
+
+	data.fd = fopen(filename, "r");
+	if (data.fd == NULL) return -EIO;
+
+	data.count = threads * TRAIN_THREAD_BATCHES;
+	data.batches = calloc(data.count, sizeof(batch_t));
+	tokenisers = malloc(sizeof(pthread_t) * threads);
+	if (data.batches == NULL || tokenisers == NULL) {
+		free(tokenisers);
+		free(data.batches);
+		fclose(data.fd);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&data.lock, NULL);
+	pthread_cond_init(&data.cond, NULL);
+	data.read = 0;
+	data.tokenised = 0;
+	data.learnt = 0;
+	data.eof = 0;
+	data.stop = 0;
+	data.ret = OK;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start)) {
+		ret = -ECLOCK;
+		goto free;
+	}
+
+	arena = arena_alloc();
+	if (arena == NULL) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	if ((flags & MEGAHAL_F_BULK) != 0) {
+		ret = model_bulk_alloc(brain, &bulk);
+		if (ret) goto free;
+	}
+
+	if (pthread_create(&reader, NULL, train_reader, &data)) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&tokenisers[started], NULL, train_tokeniser, &data)) {
+			train_stop(&data, -ENOMEM);
+			break;
+		}
+	}
+
+	for (;;) {
+		batch_t *batch;
+
+		pthread_mutex_lock(&data.lock);
+		while (!data.stop && (data.learnt == data.read
+				? !data.eof : data.batches[data.learnt % data.count].state != BATCH_DONE))
+			pthread_cond_wait(&data.cond, &data.lock);
+		if (data.stop || data.learnt == data.read) {
+			pthread_mutex_unlock(&data.lock);
+			break;
+		}
+		batch = &data.batches[data.learnt % data.count];
+		pthread_mutex_unlock(&data.lock);
+
+		ret = train_learn(arena, brain, bulk, batch);
+		if (ret) {
+			train_stop(&data, ret);
+			break;
+		}
+		lines += batch->lines;
+
+		pthread_mutex_lock(&data.lock);
+		batch->state = BATCH_FREE;
+		data.learnt++;
+		pthread_cond_broadcast(&data.cond);
+		pthread_mutex_unlock(&data.lock);
+
+		if (train_elapsed(&start) - reported >= TRAIN_REPORT_NS) {
+			reported = train_elapsed(&start);
+			train_report(lines, reported);
+		}
+	}
+
+	/* wake up the other threads if they're still waiting */
+	train_stop(&data, OK);
+
+	pthread_join(reader, NULL);
+	for (i = 0; i < started; i++)
+		pthread_join(tokenisers[i], NULL);
+
+	ret = data.ret;
+	if (ret == OK && bulk != NULL)
+		ret = model_bulk_flush(bulk);
+	if (ret == OK)
+		train_report(lines, train_elapsed(&start));
+
+free:
+	model_bulk_free(&bulk);
+	arena_free(&arena);
+	for (i = 0; i < data.count; i++) {
+		uint_fast32_t j;
+
+		for (j = 0; j < TRAIN_BATCH_LINES; j++)
+			free(data.batches[i].tokens[j].text);
+		free(data.batches[i].text);
+	}
+	pthread_cond_destroy(&data.cond);
+	pthread_mutex_destroy(&data.lock);
+	free(tokenisers);
+	free(data.batches);
+	fclose(data.fd);
+	return ret;
+}
@@ -44,11 +44,23 @@ typedef struct {
 	word_t *dict_words;
 } load_t;
 
+/* Hash table entry for a word's symbol, word 0 marks an empty slot */
 typedef struct {
 	word_t word;
 	uint32_t idx;
 } sdict_t;
 
+typedef struct {
+	db_tree *node;
+	number_t next;
+} save_stack_t;
+
+/* Child node with its dictionary symbol, for sorting */
+typedef struct {
+	uint32_t symbol;
+	db_tree *node;
+} save_child_t;
+
 typedef struct {
 	brain_t brain;
 	number_t order;
@@ -57,9 +69,20 @@ typedef struct {
 	enum file_type type;
 
 	uint_fast32_t dict_size;
-	uint_fast32_t dict_base;
+	number_t dict_mask;
 	sdict_t *dict_words;
-	char **dict_text;
+
+	/* MEGAHAL8 dictionary, stored as it will be written */
+	size_t dict_text_len;
+	size_t dict_text_size;
+	char *dict_text;
+
+	uint_fast32_t stack_size;
+	save_stack_t *stack;
+
+	/* MEGAHAL8 child ordering, re-used for every node */
+	uint_fast32_t children_size;
+	save_child_t *children;
 } save_t;
 
 static enum size_type data_size(uint64_t data) {
@@ -155,7 +178,7 @@ static int load_tree(load_t *data, db_tree *tree) {
 	uint64_t branch;
 	int ret;
 	uint8_t sizes;
-	uint_fast16_t i;
+	uint64_t i;
 
 	WARN_IF(data == NULL);
 
@@ -253,7 +276,10 @@ static int load_tree(load_t *data, db_tree *tree) {
 		tree->usage = usage;
 		tree->count = count;
 
-		ret = db_model_update(data->brain, tree);
+		if (tree->parent_id == 0)
+			ret = db_model_update(data->brain, tree);
+		else
+			ret = db_model_load_node(data->brain, tree);
 		if (ret) return ret;
 	}
 
@@ -344,7 +370,7 @@ static int load_dict(load_t *data) {
 			break;
 
 		default:
-			ret = db_word_use(tmp, &word);
+			ret = db_word_use(tmp, &word, NULL);
 			if (ret) return ret;
 
 			data->dict_words[i] = word;
@@ -362,26 +388,49 @@ static void free_loaded_dict(load_t *data) {
 }
 
 static void free_saved_dict(save_t *data) {
-	uint_fast32_t i;
-
-	if (data->dict_text != NULL) {
-		for (i = TOKENS; i < data->dict_size; i++)
-			free(data->dict_text[i]);
-	}
-
 	free(data->dict_words);
 	free(data->dict_text);
 
 	data->dict_size = 0;
+	data->dict_mask = 0;
 	data->dict_words = NULL;
+	data->dict_text_len = 0;
+	data->dict_text_size = 0;
 	data->dict_text = NULL;
 }
 
+static inline number_t dict_hash(const save_t *data, word_t word) {
+	uint64_t hash = word * 0x9E3779B97F4A7C15ULL;
+	return (hash ^ (hash >> 32)) & data->dict_mask;
+}
+
+static int append_dict_text(save_t *data, const char *text) {
+	size_t len = strlen(text);
+	void *mem;
+
+	if (len > UINT8_MAX) return -ENOSPC;
+
+	if (data->dict_text_len + 1 + len > data->dict_text_size) {
+		size_t size = data->dict_text_size > 0 ? data->dict_text_size * 2 : 4096;
+
+		while (data->dict_text_len + 1 + len > size)
+			size *= 2;
+
+		mem = realloc(data->dict_text, size);
+		if (mem == NULL) return -ENOMEM;
+		data->dict_text = mem;
+		data->dict_text_size = size;
+	}
+
+	data->dict_text[data->dict_text_len++] = len;
+	memcpy(&data->dict_text[data->dict_text_len], text, len);
+	data->dict_text_len += len;
+
+	return OK;
+}
+
 static int save_dict(save_t *data) {
 	int ret;
-	size_t len;
-	uint8_t tmp8;
-	uint_fast32_t i;
 
 	switch (data->type) {
 	case FILETYPE_MEGAHAL8:
@@ -396,41 +445,40 @@ static int save_dict(save_t *data) {
 		BUG();
 	}
 
-	for (i = 0; i < data->dict_size; i++) {
-		len = strlen(data->dict_text[i]);
-		if (len > UINT8_MAX) return -ENOSPC;
-		tmp8 = len;
-		if (!fwrite(&tmp8, sizeof(tmp8), 1, data->fd)) return -EIO;
-		if (fwrite(data->dict_text[i], sizeof(char), len, data->fd) != len) return -EIO;
-	}
+	if (fwrite(data->dict_text, sizeof(char), data->dict_text_len, data->fd) != data->dict_text_len) return -EIO;
 
 	return OK;
 }
 
 static int read_dict_size(void *data_, number_t size) {
 	save_t *data = data_;
+	number_t slots;
 	int ret;
 	void *mem;
 
-	if ((data->dict_base + size) > UINT32_MAX || (data->dict_base + size) < data->dict_base)
+	if ((data->dict_size + size) > UINT32_MAX || (data->dict_size + size) < data->dict_size)
 		return -ENOSPC;
 
 	if (data->type == FILETYPE_SQLHAL0) {
-		ret = write_data(data, SZ_64, data->dict_base + size);
+		ret = write_data(data, SZ_64, data->dict_size + size);
 		if (ret) return ret;
 	}
 
-	mem = realloc(data->dict_words, sizeof(sdict_t) * (data->dict_base + size));
-	if (mem == NULL) return -ENOMEM;
-	data->dict_words = mem;
+	/* Keep the hash table at most half full */
+	slots = 16;
+	while (slots < size * 2)
+		slots *= 2;
 
-	if (data->type == FILETYPE_SQLHAL0) {
-		free(data->dict_text);
-		data->dict_text = NULL;
-	} else {
-		mem = realloc(data->dict_text, sizeof(char *) * (data->dict_base + size));
+	free(data->dict_words);
+	data->dict_words = calloc(slots, sizeof(sdict_t));
+	if (data->dict_words == NULL) return -ENOMEM;
+	data->dict_mask = slots - 1;
+
+	if (data->type == FILETYPE_MEGAHAL8 && data->dict_text_size < data->dict_text_len + size * 8) {
+		mem = realloc(data->dict_text, data->dict_text_len + size * 8);
 		if (mem == NULL) return -ENOMEM;
 		data->dict_text = mem;
+		data->dict_text_size = data->dict_text_len + size * 8;
 	}
 
 	return OK;
@@ -438,19 +486,29 @@ static int read_dict_size(void *data_, number_t size) {
 
 static int read_dict_iter(void *data_, word_t word, number_t pos, const char *text) {
 	save_t *data = data_;
+	number_t slot;
+	int ret;
+	(void)pos;
 
 	if (data->dict_size >= UINT32_MAX) return -ENOSPC;
+	BUG_IF(word == 0);
 
-	data->dict_words[data->dict_base + pos].word = word;
-	data->dict_words[data->dict_base + pos].idx = data->dict_size;
+	slot = dict_hash(data, word);
+	while (data->dict_words[slot].word != 0) {
+		BUG_IF(data->dict_words[slot].word == word);
+		slot = (slot + 1) & data->dict_mask;
+	}
+
+	data->dict_words[slot].word = word;
+	data->dict_words[slot].idx = data->dict_size;
 
 	if (data->type == FILETYPE_SQLHAL0) {
 		uint8_t length = strlen(text);
 		if (!fwrite(&length, sizeof(length), 1, data->fd)) return -EIO;
 		if (fwrite(text, sizeof(char), length, data->fd) != length) return -EIO;
 	} else {
-		data->dict_text[data->dict_size] = strdup(text);
-		if (data->dict_text[data->dict_size] == NULL) return -ENOMEM;
+		ret = append_dict_text(data, text);
+		if (ret) return ret;
 	}
 
 	data->dict_size++;
@@ -458,24 +516,24 @@ static int read_dict_iter(void *data_, word_t word, number_t pos, const char *te
 }
 
 static int init_dict(save_t *data) {
-	data->dict_size = 0;
-
-	data->dict_words = malloc(sizeof(sdict_t) * TOKENS);
-	if (data->dict_words == NULL) return -ENOMEM;
+	int ret;
 
-	data->dict_text = malloc(sizeof(char *) * TOKENS);
-	if (data->dict_text == NULL) return -ENOMEM;
+	data->dict_size = 0;
+	data->dict_mask = 0;
+	data->dict_words = NULL;
+	data->dict_text_len = 0;
+	data->dict_text_size = 0;
+	data->dict_text = NULL;
 
-	data->dict_words[TOKEN_ERROR_IDX].word = 0;
-	data->dict_words[TOKEN_ERROR_IDX].idx = TOKEN_ERROR_IDX;
-	data->dict_text[TOKEN_ERROR_IDX] = TOKEN_ERROR;
+	if (data->type == FILETYPE_MEGAHAL8) {
+		ret = append_dict_text(data, TOKEN_ERROR);
+		if (ret) return ret;
 
-	data->dict_words[TOKEN_FIN_IDX].word = 0;
-	data->dict_words[TOKEN_FIN_IDX].idx = TOKEN_FIN_IDX;
-	data->dict_text[TOKEN_FIN_IDX] = TOKEN_FIN;
+		ret = append_dict_text(data, TOKEN_FIN);
+		if (ret) return ret;
+	}
 
 	data->dict_size = TOKENS;
-	data->dict_base = data->dict_size;
 
 	return OK;
 }
@@ -493,55 +551,85 @@ static int read_dict(save_t *data) {
 }
 
 static int find_word(save_t *data, word_t word, uint32_t *symbol) {
-	uint_fast32_t min = 0;
-	uint_fast32_t pos;
-	uint_fast32_t max = data->dict_size - 1;
+	number_t slot;
 
 	WARN_IF(word == 0);
 
-	while (1) {
-		pos = (min + max) / 2;
-
-		if (word == data->dict_words[pos].word) {
-			BUG_IF(pos == TOKEN_ERROR_IDX);
-			BUG_IF(pos == TOKEN_FIN_IDX);
-			*symbol = data->dict_words[pos].idx;
-			return OK;
-		} else if (word > data->dict_words[pos].word) {
-			if (max == pos) {
-				log_error("find_word", word, "Word missing from dictionary");
-				return -ENOTFOUND;
-			}
-			min = pos + 1;
-		} else {
-			if (min == pos) {
-				log_error("find_word", word, "Word missing from dictionary");
-				return -ENOTFOUND;
+	if (data->dict_words != NULL) {
+		slot = dict_hash(data, word);
+
+		while (data->dict_words[slot].word != 0) {
+			if (data->dict_words[slot].word == word) {
+				*symbol = data->dict_words[slot].idx;
+				return OK;
 			}
-			max = pos - 1;
+
+			slot = (slot + 1) & data->dict_mask;
 		}
 	}
+
+	log_error("find_word", word, "Word missing from dictionary");
+	return -ENOTFOUND;
 }
 
-static int save_tree(save_t *data, db_tree **tree) {
-	db_tree *tree_p;
+static int compare_child(const void *a_, const void *b_) {
+	const save_child_t *a = a_;
+	const save_child_t *b = b_;
+
+	return a->symbol < b->symbol ? -1 : a->symbol > b->symbol;
+}
+
+/*
+ * MegaHAL expects the children of each node to be ordered by word. The
+ * dictionary is read in word order so the symbols already give the order
+ * (the children are filled in no particular order). FIN sorts last.
+ */
+static int sort_children(save_t *data, db_tree *tree_p) {
+	number_t i;
 	int ret;
-	uint32_t word;
-	uint_fast32_t i;
 
-	WARN_IF(data == NULL);
-	WARN_IF(data->brain == 0);
-	WARN_IF(tree == NULL);
-	WARN_IF(*tree == NULL);
+	if (tree_p->children < 2)
+		return OK;
 
-	if (data->dict_size > UINT16_MAX)
-		return -ENOSPC;
+	if (tree_p->children > data->children_size) {
+		void *mem = realloc(data->children, sizeof(save_child_t) * tree_p->children);
+		if (mem == NULL) return -ENOMEM;
+		data->children = mem;
+		data->children_size = tree_p->children;
+	}
+
+	for (i = 0; i < tree_p->children; i++) {
+		db_tree *child = tree_p->nodes[i];
+
+		data->children[i].node = child;
+		if (child->word == 0) {
+			data->children[i].symbol = UINT32_MAX;
+		} else {
+			ret = find_word(data, child->word, &data->children[i].symbol);
+			if (ret) return ret;
+		}
+	}
+
+	qsort(data->children, tree_p->children, sizeof(save_child_t), compare_child);
 
-	tree_p = *tree;
+	for (i = 0; i < tree_p->children; i++)
+		tree_p->nodes[i] = data->children[i].node;
+
+	return OK;
+}
+
+static int save_node(save_t *data, db_tree *tree_p) {
+	int ret;
+	uint32_t word;
 
 	ret = db_model_node_fill(data->brain, tree_p);
 	if (ret) return ret;
 
+	if (data->type == FILETYPE_MEGAHAL8) {
+		ret = sort_children(data, tree_p);
+		if (ret) return ret;
+	}
+
 	if (tree_p->word == 0) {
 		if (tree_p->parent_id == 0) {
 			BUG_IF(tree_p->count != 0);
@@ -664,13 +752,113 @@ static int save_tree(save_t *data, db_tree **tree) {
 		BUG();
 	}
 
-	for (i = 0; i < tree_p->children; i++) {
-		ret = save_tree(data, (db_tree **)&tree_p->nodes[i]);
+	return OK;
+}
+
+static int grow_save_stack(save_t *data) {
+	uint_fast32_t size;
+	uint_fast32_t i;
+	void *mem;
+
+	size = data->stack_size > 0 ? data->stack_size * 2 : 8;
+
+	mem = realloc(data->stack, sizeof(save_stack_t) * size);
+	if (mem == NULL) return -ENOMEM;
+	data->stack = mem;
+
+	for (i = data->stack_size; i < size; i++)
+		data->stack[i].node = NULL;
+	data->stack_size = size;
+
+	return OK;
+}
+
+static void free_save_stack(save_t *data) {
+	uint_fast32_t i;
+
+	/* The first entry is the root node, which belongs to the caller */
+	for (i = 1; i < data->stack_size; i++)
+		db_model_node_free(&data->stack[i].node);
+	free(data->stack);
+
+	data->stack_size = 0;
+	data->stack = NULL;
+}
+
+/*
+ * Save the tree depth-first using an explicit stack. Each level of the
+ * stack keeps one node (and its children) which are re-used for every
+ * node visited at that depth.
+ */
+static int save_tree(save_t *data, db_tree **tree) {
+	save_stack_t *frame;
+	db_tree *child;
+	uint_fast32_t depth;
+	int ret;
+
+	WARN_IF(data == NULL);
+	WARN_IF(data->brain == 0);
+	WARN_IF(tree == NULL);
+	WARN_IF(*tree == NULL);
+
+	if (data->type == FILETYPE_MEGAHAL8 && data->dict_size > UINT16_MAX)
+		return -ENOSPC;
+
+	if (data->stack_size == 0) {
+		ret = grow_save_stack(data);
 		if (ret) return ret;
 	}
+
+	depth = 0;
+	frame = &data->stack[depth];
+	frame->node = *tree;
+	frame->next = 0;
+
+	ret = save_node(data, frame->node);
+	if (ret) goto fail;
+
+	while (1) {
+		frame = &data->stack[depth];
+
+		if (frame->next == frame->node->children) {
+			if (depth == 0) break;
+			depth--;
+			continue;
+		}
+
+		child = frame->node->nodes[frame->next++];
+
+		depth++;
+		if (depth == data->stack_size) {
+			ret = grow_save_stack(data);
+			if (ret) goto fail;
+		}
+
+		frame = &data->stack[depth];
+		if (frame->node == NULL) {
+			frame->node = db_model_node_alloc();
+			if (frame->node == NULL) {
+				ret = -ENOMEM;
+				goto fail;
+			}
+		}
+
+		frame->node->id = child->id;
+		frame->node->parent_id = child->parent_id;
+		frame->next = 0;
+
+		ret = save_node(data, frame->node);
+		if (ret) goto fail;
+	}
+
+	data->stack[0].node = NULL;
 	db_model_node_free(tree);
 
 	return OK;
+
+fail:
+	data->stack[0].node = NULL;
+	return ret;
 }
 
 int load_brain(const char *name, const char *filename) {
@@ -743,6 +931,9 @@ int load_brain(const char *name, const char *filename) {
 		if (fseek(data.fd, sizeof(char) * COOKIE_LEN + sizeof(tmp8), SEEK_SET)) return -EIO;
 	}
 
+	ret = db_model_load_begin(data.brain);
+	if (ret) goto fail;
+
 	ret = load_tree(&data, forward);
 	if (ret) goto fail;
 
@@ -757,9 +948,15 @@ int load_brain(const char *name, const char *filename) {
 
 	log_info("load_brain", 0, "Backward tree loaded");
 
+	ret = db_model_load_end(data.brain);
+	if (ret) goto fail;
+
+	log_info("load_brain", 0, "Nodes added to model");
+
 	free_loaded_dict(&data);
 
 fail:
+	db_model_load_abort();
 	fclose(data.fd);
 	return ret;
 }
@@ -791,6 +988,12 @@ int save_brain(const char *name, enum file_type type, const char *filename) {
 	log_info("save_brain", 0, filename);
 
 	data.type = type;
+	data.dict_words = NULL;
+	data.dict_text = NULL;
+	data.stack_size = 0;
+	data.stack = NULL;
+	data.children_size = 0;
+	data.children = NULL;
 	data.fd = fopen(filename, "w");
 	if (data.fd == NULL) return -EIO;
 
@@ -819,6 +1022,12 @@ int save_brain(const char *name, enum file_type type, const char *filename) {
 
 		log_info("save_brain", data.dict_size, "Dictionary read");
 
+		if (data.dict_size > UINT16_MAX) {
+			log_error("save_brain", data.dict_size, "Cannot save MegaHAL brains with more than 2^16-1 words");
+			ret = -ENOSPC;
+			goto fail;
+		}
+
 		ret = save_tree(&data, &forward); /* forward */
 		if (ret) goto fail;
 
@@ -856,9 +1065,10 @@ int save_brain(const char *name, enum file_type type, const char *filename) {
 		BUG();
 	}
 
-	free_saved_dict(&data);
-
 fail:
+	free_saved_dict(&data);
+	free_save_stack(&data);
+	free(data.children);
 	fclose(data.fd);
 	return ret;
 }
@@ -928,6 +1138,9 @@ int model_update(model_t *model, word_t word, int persist) {
 
 	BUG_IF(model == NULL);
 
+	if (persist)
+		return db_model_use(model->brain, model->contexts, model->order + 2, word);
+
 	for (i = model->order + 1; i > 0; i--)
 		if (model->contexts[i - 1] != NULL) {
 			ret = db_model_node_find(model->brain, model->contexts[i - 1], word, &model->contexts[i]);
@@ -936,36 +1149,6 @@ int model_update(model_t *model, word_t word, int persist) {
 			} else if (ret != OK) {
 				return ret;
 			}
-
-			if (persist) {
-				if (ret == -ENOTFOUND) {
-					model->contexts[i] = db_model_node_alloc();
-					if (model->contexts[i] == NULL) return -ENOMEM;
-
-					model->contexts[i]->word = word;
-
-					ret = db_model_link(model->contexts[i - 1], model->contexts[i]);
-					if (ret) return ret;
-
-					model->contexts[i]->count = 1;
-
-					ret = db_model_update(model->brain, model->contexts[i]);
-					if (ret) return ret;
-				} else {
-					if (model->contexts[i]->count < (number_t)~0)
-						model->contexts[i]->count++;
-
-					ret = db_model_update(model->brain, model->contexts[i]);
-					if (ret) return ret;
-				}
-
-				if (model->contexts[i - 1]->usage < (number_t)~0) {
-					model->contexts[i - 1]->usage++;
-
-					ret = db_model_update(model->brain, model->contexts[i - 1]);
-					if (ret) return ret;
-				}
-			}
 		}
 
 	return OK;
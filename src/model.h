@@ -31,3 +31,22 @@ int model_rand_init(const model_t *model, model_rand_t *state);
 int model_rand_next(model_rand_t *state, word_t *word);
 void model_rand_free(model_rand_t *state);
 void model_free(model_t **model);
+
+typedef struct {
+	brain_t brain;
+	number_t order;
+	uint32_t *contexts;
+
+	db_merge_node *nodes;
+	uint32_t size;
+	uint32_t capacity;
+
+	/* (parent, word) to node index + 1 */
+	uint32_t *hash;
+	uint32_t mask;
+} model_bulk_t;
+
+int model_bulk_alloc(brain_t brain, model_bulk_t **bulk);
+int model_bulk_learn(model_bulk_t *bulk, const list_t *input);
+int model_bulk_flush(model_bulk_t *bulk);
+void model_bulk_free(model_bulk_t **bulk);
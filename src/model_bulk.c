@@ -0,0 +1,258 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "err.h"
+#include "db.h"
+#include "dict.h"
+#include "model.h"
+#include "output.h"
+
+/*
+ * Bulk training counts the contexts of every input in memory (updating
+ * them in the same way as model_update) and then merges the counts into
+ * the model in the database. This writes each distinct node once per
+ * merge instead of once for every time it is used.
+ *
+ * When the number of nodes reaches MODEL_BULK_NODES, they're merged
+ * into the database and counting starts again from empty trees.
+ */
+#define MODEL_BULK_NODES (1 << 22)
+
+#define BULK_FORWARD 0
+#define BULK_BACKWARD 1
+#define BULK_NONE UINT32_MAX
+
+static inline uint32_t bulk_hash(const model_bulk_t *bulk, uint32_t parent, word_t word) {
+	uint64_t hash = (word ^ ((uint64_t)parent << 40)) * 0x9E3779B97F4A7C15ULL;
+	return (uint32_t)(hash ^ (hash >> 32)) & bulk->mask;
+}
+
+static int bulk_add(model_bulk_t *bulk, uint32_t parent, word_t word, uint32_t *index) {
+	db_merge_node *node;
+
+	if (bulk->size == bulk->capacity) {
+		void *mem = realloc(bulk->nodes, sizeof(db_merge_node) * bulk->capacity * 2);
+		if (mem == NULL) return -ENOMEM;
+
+		bulk->nodes = mem;
+		bulk->capacity *= 2;
+	}
+
+	*index = bulk->size++;
+	node = &bulk->nodes[*index];
+	node->parent = parent;
+	node->depth = parent == BULK_NONE ? 0 : bulk->nodes[parent].depth + 1;
+	node->word = word;
+	node->usage = 0;
+	node->count = 0;
+	return OK;
+}
+
+static int bulk_rehash(model_bulk_t *bulk) {
+	uint32_t mask = bulk->mask * 2 + 1;
+	uint32_t *hash;
+	uint32_t i;
+
+	hash = calloc((size_t)mask + 1, sizeof(uint32_t));
+	if (hash == NULL) return -ENOMEM;
+
+	free(bulk->hash);
+	bulk->hash = hash;
+	bulk->mask = mask;
+
+	for (i = 0; i < bulk->size; i++) {
+		uint32_t slot;
+
+		if (bulk->nodes[i].depth == 0) continue;
+
+		slot = bulk_hash(bulk, bulk->nodes[i].parent, bulk->nodes[i].word);
+		while (bulk->hash[slot] != 0)
+			slot = (slot + 1) & bulk->mask;
+		bulk->hash[slot] = i + 1;
+	}
+
+	return OK;
+}
+
+/* Find or create the child of a node. */
+static int bulk_child(model_bulk_t *bulk, uint32_t parent, word_t word, uint32_t *index) {
+	uint32_t slot;
+	int ret;
+
+	slot = bulk_hash(bulk, parent, word);
+	while (bulk->hash[slot] != 0) {
+		db_merge_node *node = &bulk->nodes[bulk->hash[slot] - 1];
+
+		if (node->parent == parent && node->word == word) {
+			*index = bulk->hash[slot] - 1;
+			return OK;
+		}
+
+		slot = (slot + 1) & bulk->mask;
+	}
+
+	ret = bulk_add(bulk, parent, word, index);
+	if (ret) return ret;
+
+	bulk->hash[slot] = *index + 1;
+
+	if (bulk->size > bulk->mask / 2)
+		return bulk_rehash(bulk);
+
+	return OK;
+}
+
+static void bulk_reset(model_bulk_t *bulk) {
+	uint32_t index;
+
+	memset(bulk->hash, 0, sizeof(uint32_t) * ((size_t)bulk->mask + 1));
+	bulk->size = 0;
+
+	/* capacity is always enough for the roots */
+	bulk_add(bulk, BULK_NONE, 0, &index);
+	bulk_add(bulk, BULK_NONE, 0, &index);
+}
+
+static void bulk_init(model_bulk_t *bulk, uint32_t root) {
+	uint_fast32_t i;
+
+	bulk->contexts[0] = root;
+	for (i = 1; i < bulk->order + 2; i++)
+		bulk->contexts[i] = BULK_NONE;
+}
+
+/* Equivalent to model_update(model, word, 1) */
+static int bulk_update(model_bulk_t *bulk, word_t word) {
+	uint_fast32_t i;
+	int ret;
+
+	for (i = bulk->order + 1; i > 0; i--)
+		if (bulk->contexts[i - 1] != BULK_NONE) {
+			ret = bulk_child(bulk, bulk->contexts[i - 1], word, &bulk->contexts[i]);
+			if (ret) return ret;
+
+			if (bulk->nodes[bulk->contexts[i]].count < (number_t)~0)
+				bulk->nodes[bulk->contexts[i]].count++;
+
+			if (bulk->nodes[bulk->contexts[i - 1]].usage < (number_t)~0)
+				bulk->nodes[bulk->contexts[i - 1]].usage++;
+		}
+
+	return OK;
+}
+
+int model_bulk_alloc(brain_t brain, model_bulk_t **bulk) {
+	model_bulk_t *bulk_p;
+	int ret;
+
+	*bulk = malloc(sizeof(model_bulk_t));
+	if (*bulk == NULL) return -ENOMEM;
+	bulk_p = *bulk;
+
+	bulk_p->brain = brain;
+	bulk_p->contexts = NULL;
+	bulk_p->nodes = NULL;
+	bulk_p->hash = NULL;
+
+	ret = db_model_get_order(brain, &bulk_p->order);
+	if (ret) goto fail;
+
+	bulk_p->contexts = malloc(sizeof(uint32_t) * (bulk_p->order + 2));
+	bulk_p->capacity = 4096;
+	bulk_p->nodes = malloc(sizeof(db_merge_node) * bulk_p->capacity);
+	bulk_p->mask = bulk_p->capacity * 2 - 1;
+	bulk_p->hash = malloc(sizeof(uint32_t) * ((size_t)bulk_p->mask + 1));
+	if (bulk_p->contexts == NULL || bulk_p->nodes == NULL || bulk_p->hash == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	bulk_reset(bulk_p);
+	return OK;
+
+fail:
+	model_bulk_free(bulk);
+	return ret;
+}
+
+int model_bulk_learn(model_bulk_t *bulk, const list_t *input) {
+	uint_fast32_t i;
+	uint32_t size;
+	int ret;
+
+	BUG_IF(bulk == NULL);
+
+	/* We only learn from inputs which are long enough */
+	ret = list_size(input, &size);
+	if (ret) return ret;
+
+	if (size <= bulk->order) return OK;
+
+	bulk_init(bulk, BULK_FORWARD);
+
+	for (i = 0; i < size; i++) {
+		word_t word;
+
+		ret = list_get(input, i, &word);
+		if (ret) return ret;
+
+		ret = bulk_update(bulk, word);
+		if (ret) return ret;
+	}
+
+	ret = bulk_update(bulk, 0);
+	if (ret) return ret;
+
+	bulk_init(bulk, BULK_BACKWARD);
+
+	for (i = 0; i < size; i++) {
+		word_t word;
+
+		ret = list_get(input, (size - 1) - i, &word);
+		if (ret) return ret;
+
+		ret = bulk_update(bulk, word);
+		if (ret) return ret;
+	}
+
+	ret = bulk_update(bulk, 0);
+	if (ret) return ret;
+
+	if (bulk->size >= MODEL_BULK_NODES)
+		return model_bulk_flush(bulk);
+
+	return OK;
+}
+
+int model_bulk_flush(model_bulk_t *bulk) {
+	char msg[128];
+	int ret;
+
+	BUG_IF(bulk == NULL);
+
+	/* nothing learnt */
+	if (bulk->nodes[BULK_FORWARD].usage == 0 && bulk->nodes[BULK_BACKWARD].usage == 0)
+		return OK;
+
+	snprintf(msg, sizeof(msg), "Merging %lu nodes", (unsigned long int)bulk->size);
+	log_info("model_bulk_flush", OK, msg);
+
+	ret = db_model_merge(bulk->brain, bulk->nodes, bulk->size, BULK_FORWARD, BULK_BACKWARD);
+	if (ret) return ret;
+
+	bulk_reset(bulk);
+	return OK;
+}
+
+void model_bulk_free(model_bulk_t **bulk) {
+	if (*bulk == NULL) return;
+
+	free((*bulk)->contexts);
+	free((*bulk)->nodes);
+	free((*bulk)->hash);
+	free(*bulk);
+	*bulk = NULL;
+}
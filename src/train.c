@@ -9,7 +9,7 @@
 #include "megahal.h"
 #include "output.h"
 
-static int input_file(const char *name, const char *filename) {
+static int input_file(const char *name, const char *filename, unsigned int threads, uint8_t flags) {
 	int ret = OK;
 	brain_t brain;
 
@@ -18,7 +18,7 @@ static int input_file(const char *name, const char *filename) {
 	ret = db_brain_use(name, &brain);
 	if (ret) goto fail;
 
-	ret = megahal_train(brain, filename);
+	ret = megahal_train(brain, filename, threads, flags);
 	if (ret) goto fail;
 
 fail:
@@ -31,10 +31,34 @@ int main(int argc, char *argv[]) {
 	int ret;
 	int fail = 0;
 	char *state;
+	unsigned int threads = 1;
+	uint8_t flags = 0;
+	char *prog = argv[0];
+
+	while (argc > 3) {
+		if (!strcmp(argv[1], "--bulk")) {
+			flags |= MEGAHAL_F_BULK;
+			argc--;
+			argv++;
+		} else if (argc > 4 && !strcmp(argv[1], "-j")) {
+			char *end;
+			unsigned long int value;
+
+			value = strtoul(argv[2], &end, 10);
+			if (argv[2][0] < '0' || argv[2][0] > '9' || *end != 0 || value > MEGAHAL_MAX_THREADS)
+				value = 0;
+			threads = value;
+			argc -= 2;
+			argv += 2;
+		} else {
+			break;
+		}
+	}
 
-	if (argc != 3) {
+	if (argc != 3 || threads == 0) {
 		printf("Brain training\n");
-		printf("Usage: %s <name> <filename>\n", argv[0]);
+		printf("Usage: %s [-j threads] [--bulk] <name> <filename>\n", prog);
+		printf("(threads must be from 1 to %u)\n", MEGAHAL_MAX_THREADS);
 		return 1;
 	}
 
@@ -52,7 +76,7 @@ int main(int argc, char *argv[]) {
 	else log_info("train", ret, state);
 
 	state = "input_file";
-	ret = input_file(name, file);
+	ret = input_file(name, file, threads, flags);
 	if (ret) { log_warn("train", ret, state); fail = 1; }
 	else log_info("train", ret, state);
 
@@ -68,6 +92,8 @@ int main(int argc, char *argv[]) {
 		else log_info("train", ret, state);
 	}
 
+	db_model_node_log_stats("train");
+
 	state = "db_disconnect";
 	ret = db_disconnect();
 	if (ret) goto fail;
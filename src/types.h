@@ -14,12 +14,34 @@ typedef uint64_t tree_t;
 
 typedef uint64_t number_t;
 
+typedef struct arena arena_t;
+
+/* words stored inline before allocating */
+#define DICT_INLINE 16
+#define LIST_INLINE 64
+#define SET_INLINE  64
+
 typedef struct {
+	arena_t *arena; /* allocate from arena (if not NULL) */
 	uint_fast32_t size;
+	uint_fast32_t capacity;
 	word_t *words;
+	word_t buffer[DICT_INLINE];
 } dict_t;
 
 typedef struct {
+	arena_t *arena; /* allocate from arena (if not NULL) */
+	uint_fast32_t head; /* position of the first word (space to prepend) */
 	uint_fast32_t size;
+	uint_fast32_t capacity;
 	word_t *words;
+	word_t buffer[LIST_INLINE];
 } list_t;
+
+typedef struct {
+	arena_t *arena; /* allocate from arena (if not NULL) */
+	uint_fast32_t size;
+	uint_fast32_t mask;
+	word_t *words; /* open addressing (0 is empty) */
+	word_t buffer[SET_INLINE];
+} set_t;